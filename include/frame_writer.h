@@ -0,0 +1,52 @@
+#ifndef RASTERIZER_FRAME_WRITER_H
+#define RASTERIZER_FRAME_WRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tgaimage.h"
+
+// Writes frames to RLE TGA files on a background thread. push() copies the
+// frame into a queue of at most `capacity` snapshots and returns at once;
+// it only blocks while the queue is full. Snapshot buffers are recycled, so
+// a steady stream of same-sized frames does not allocate.
+class FrameWriter {
+ public:
+  explicit FrameWriter(std::size_t capacity = 4);
+  ~FrameWriter();  // writes the frames still queued
+  FrameWriter(const FrameWriter&) = delete;
+  FrameWriter& operator=(const FrameWriter&) = delete;
+
+  // `vflip` as in TGAImage::write_tga_file.
+  void push(const TGAImage& frame, std::string filename, bool vflip = true);
+  // Waits until every frame pushed so far is on disk.
+  void flush();
+
+  std::size_t written() const;
+  std::size_t failed() const;
+
+ private:
+  struct Job {
+    TGAImage frame;
+    std::string filename;
+    bool vflip;
+  };
+
+  void run();
+
+  const std::size_t capacity;
+  mutable std::mutex mutex;
+  std::condition_variable not_full, not_empty, idle;
+  std::deque<Job> queue;
+  std::vector<TGAImage> spare;  // buffers of written frames
+  bool writing = false;         // a job is out of the queue, being written
+  bool stopping = false;
+  std::size_t frames_written = 0, frames_failed = 0;
+  std::thread worker;
+};
+
+#endif  // RASTERIZER_FRAME_WRITER_H
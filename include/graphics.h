@@ -1,17 +1,303 @@
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
 #include "mesh.h"
 #include "tgaimage.h"
 
 void lookat(const vec3 eye, const vec3 center, const vec3 up);
 void init_perspective(const double f);
-void init_viewport(const int x, const int y, const int w, const int h);
-void init_zbuffer(const int width, const int height);
+// Both return false, and change nothing, for sizes the fixed-point
+// rasterizer can't hold: see MAX_FRAMEBUFFER_SIZE.
+bool init_viewport(const int x, const int y, const int w, const int h);
+// Storage format of the depth buffer. Depth is reversed: near_w / w, 1 at
+// the near plane and 0 at infinity, which keeps F32 precise far away. D24
+// packs depth into the low 24 bits of a 32-bit word and leaves 8 spare bits;
+// D16 halves the depth traffic but resolves the scene more coarsely.
+enum class DepthFormat { F32, D24, D16 };
+
+bool init_zbuffer(const int width, const int height,
+                  DepthFormat format = DepthFormat::F32);
+DepthFormat depth_format();
+const char* depth_format_name(DepthFormat format);
+// Clears the depth buffer and the framebuffer of the next frame in O(tiles):
+// rasterize_bins() resets each tile when it visits it, and only if it has
+// been drawn to since its last reset.
+void clear_buffers();
+
+// Per-vertex outputs of a vertex shader besides the position. They are
+// interpolated perspective-correctly and handed to the fragment shader.
+constexpr int MAX_VARYINGS = 12;
+typedef float Varyings[MAX_VARYINGS];
+
+struct RasterTriangle;
+
+// A 2x2 block of fragments at even (x, y). Lanes are (x, y), (x + 1, y),
+// (x, y + 1) and (x + 1, y + 1); the ones missing from `mask` are helper
+// lanes, interpolated off the triangle so that derivatives stay defined.
+struct FragmentQuad {
+  int x, y;
+  unsigned mask;  // covered lanes
+  float varyings[MAX_VARYINGS][4];
+
+  // Screen-space derivatives of varying k, taken across the quad.
+  float ddx(int k) const { return varyings[k][1] - varyings[k][0]; }
+  float ddy(int k) const { return varyings[k][2] - varyings[k][0]; }
+};
+
+// Shades rows y and y + 1 (y even) of a triangle from pixel x0 (even) on.
+// Bit i of mask[r] is pixel x0 + i of row y + r; on return it is set for
+// the fragments that were not discarded, whose colors are in colors[r][i].
+// Returns the number of shader lanes run, helper lanes included.
+typedef int (*QuadShader)(const RasterTriangle& t, int x0, int y,
+                          std::uint64_t mask[2], TGAColor (*colors)[64]);
 
+// A shader serves a whole draw; `primitive` is the index of the triangle
+// being shaded in the draw, as passed to setup_raster_triangles().
 struct IShader {
+  int nvaryings = 0;  // leading Varyings entries the fragment shader reads
   virtual std::pair<bool, TGAColor> fragment(
-      const vec3 bar) const = 0;  // discard pixel or not
+      const float* varyings, int primitive) const = 0;  // discard pixel or not
+  // Batch entry point: shades the four lanes of `quad` into colors[lane]
+  // and returns the lanes that were not discarded, covered or not. The
+  // default runs fragment() lane by lane.
+  virtual unsigned fragment_quad(const FragmentQuad& quad, int primitive,
+                                 TGAColor colors[4]) const;
+  // Quad loop used for this shader's triangles. Final shader types return
+  // shade_quads<Self> so their fragment_quad() is inlined even when they are
+  // only known as an IShader; the default dispatches virtually per quad.
+  // Unbatched, fragment() is called once per covered pixel instead.
+  virtual QuadShader quad_shader(bool batched) const;
 };
 
 typedef vec4 Triangle[3];
 
-void rasterize(const Triangle &clip, const IShader& shader,
-               TGAImage& framebuffer);
\ No newline at end of file
+// Sub-pixel precision of the rasterizer: screen positions are snapped to
+// 1/SUBPIXEL_ONE of a pixel before the edge equations are built.
+constexpr int SUBPIXEL_BITS = 8;
+constexpr int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+// Largest screen coordinate (in pixels) the edge equations can hold: edge
+// steps must fit the span kernels' 32-bit lanes.
+constexpr int MAX_SCREEN_COORD = 16384;
+// Largest framebuffer side, and largest viewport offset and side. Triangles
+// are clipped to a guard band of MAX_SCREEN_COORD - side pixels around the
+// viewport center, which always covers the whole framebuffer.
+constexpr int MAX_FRAMEBUFFER_SIZE = MAX_SCREEN_COORD / 2;
+
+// Triangle setup: integer edge equations e = a*x + b*y + c in sub-pixel
+// units and the inclusive pixel bounding box. A pixel is covered when every
+// edge value is greater than its threshold (top-left fill rule).
+struct TriangleSetup {
+  std::int64_t a[3], b[3], c[3];
+  std::int64_t threshold[3];
+  double inv_area2;  // 1 / (2 * signed area)
+  int minx, maxx, miny, maxy;
+};
+
+bool setup_triangle(const vec2 screen[3], TriangleSetup& setup);
+
+// Instruction set of the coverage/depth kernel. The widest one the CPU
+// supports is picked at startup; the others can be forced for A/B runs and
+// all of them produce bit-identical images.
+enum class RasterIsa { Scalar, SSE41, AVX2, AVX512 };
+
+bool raster_isa_supported(RasterIsa isa);
+RasterIsa raster_isa();
+bool set_raster_isa(RasterIsa isa);  // false if the CPU lacks it
+const char* raster_isa_name(RasterIsa isa);
+
+// Attribute plane c + dx * (x - minx) + dy * (y - miny) over the pixels of a
+// triangle.
+struct AttributePlane {
+  float c, dx, dy;
+};
+
+// A triangle after clipping and setup, ready to be drawn into any tile it
+// overlaps. Varyings are interpolated as varyings[k] / inv_w, both planes
+// being linear in screen space.
+struct RasterTriangle {
+  TriangleSetup setup;
+  double z0, dzdx, dzdy;  // depth plane, relative to pixel (minx, miny)
+  float zmin, zmax;       // conservative depth range
+  int nvaryings;
+  AttributePlane inv_w;   // 1 / w
+  AttributePlane varyings[MAX_VARYINGS];  // varying / w
+  const IShader* shader;
+  QuadShader shade;  // shade_quads instantiated for the shader's type
+  int primitive;
+};
+
+// Values of t's 1/w and varying planes at the start of row y. Index 0 is
+// 1/w, index k + 1 varying k.
+inline void varying_row(const RasterTriangle& t, int y, float* row) {
+  float dy = (float)(y - t.setup.miny);
+  row[0] = t.inv_w.c + t.inv_w.dy * dy;
+  for (int k = 0; k < t.nvaryings; k++)
+    row[k + 1] = t.varyings[k].c + t.varyings[k].dy * dy;
+}
+
+// Perspective-correct varyings of pixel x on the row given by varying_row().
+inline void interpolate_varyings(const RasterTriangle& t, const float* row,
+                                 int x, float* out) {
+  float dx = (float)(x - t.setup.minx);
+  float w = 1 / (row[0] + t.inv_w.dx * dx);
+  for (int k = 0; k < t.nvaryings; k++)
+    out[k] = (row[k + 1] + t.varyings[k].dx * dx) * w;
+}
+
+// Same for the four lanes of quad, rows[r] being the row of quad.y + r.
+inline void interpolate_quad(const RasterTriangle& t, const float (*rows)[MAX_VARYINGS + 1],
+                             FragmentQuad& quad) {
+  for (int lane = 0; lane < 4; lane++) {
+    const float* row = rows[lane >> 1];
+    float dx = (float)(quad.x + (lane & 1) - t.setup.minx);
+    float w = 1 / (row[0] + t.inv_w.dx * dx);
+    for (int k = 0; k < t.nvaryings; k++)
+      quad.varyings[k][lane] = (row[k + 1] + t.varyings[k].dx * dx) * w;
+  }
+}
+
+inline unsigned IShader::fragment_quad(const FragmentQuad& quad, int primitive,
+                                       TGAColor colors[4]) const {
+  unsigned kept = 0;
+  for (int lane = 0; lane < 4; lane++) {
+    Varyings varyings;
+    for (int k = 0; k < nvaryings; k++) varyings[k] = quad.varyings[k][lane];
+    std::pair<bool, TGAColor> fragment = this->fragment(varyings, primitive);
+    if (fragment.first) continue;
+    colors[lane] = fragment.second;
+    kept |= 1u << lane;
+  }
+  return kept;
+}
+
+// QuadShader for triangles whose shader is a ShaderT. The shader is called
+// non-virtually, so it is inlined into the quad loop; with ShaderT = IShader
+// this is the virtual-dispatch fallback.
+template <class ShaderT>
+int shade_quads(const RasterTriangle& t, int x0, int y, std::uint64_t mask[2],
+                TGAColor (*colors)[64]) {
+  static_assert(std::is_same_v<ShaderT, IShader> || !std::is_abstract_v<ShaderT>,
+                "shade_quads needs the shader's final type");
+  const ShaderT& shader = static_cast<const ShaderT&>(*t.shader);
+  float rows[2][MAX_VARYINGS + 1];
+  varying_row(t, y, rows[0]);
+  varying_row(t, y + 1, rows[1]);
+  // Bit 2q of `quads` is set when quad q has a covered pixel.
+  std::uint64_t any = mask[0] | mask[1];
+  std::uint64_t quads = (any | any >> 1) & 0x5555555555555555ull;
+  std::uint64_t kept[2] = {0, 0};
+  int lanes = 0;
+  for (; quads; quads &= quads - 1) {
+    int i = std::countr_zero(quads);
+    FragmentQuad quad;
+    quad.x = x0 + i;
+    quad.y = y;
+    quad.mask = (unsigned)(mask[0] >> i & 3) | (unsigned)(mask[1] >> i & 3) << 2;
+    interpolate_quad(t, rows, quad);
+    TGAColor quad_colors[4];
+    unsigned shaded;
+    if constexpr (std::is_same_v<ShaderT, IShader>)
+      shaded = shader.fragment_quad(quad, t.primitive, quad_colors);
+    else
+      shaded = shader.ShaderT::fragment_quad(quad, t.primitive, quad_colors);
+    for (unsigned m = shaded & quad.mask; m; m &= m - 1) {
+      int lane = std::countr_zero(m);
+      colors[lane >> 1][i + (lane & 1)] = quad_colors[lane];
+      kept[lane >> 1] |= 1ull << (i + (lane & 1));
+    }
+    lanes += 4;
+  }
+  mask[0] = kept[0];
+  mask[1] = kept[1];
+  return lanes;
+}
+
+// QuadShader that calls ShaderT's fragment() once per covered pixel: no
+// helper lanes and no derivatives.
+template <class ShaderT>
+int shade_pixels(const RasterTriangle& t, int x0, int y, std::uint64_t mask[2],
+                 TGAColor (*colors)[64]) {
+  static_assert(std::is_same_v<ShaderT, IShader> || !std::is_abstract_v<ShaderT>,
+                "shade_pixels needs the shader's final type");
+  const ShaderT& shader = static_cast<const ShaderT&>(*t.shader);
+  int lanes = 0;
+  for (int r = 0; r < 2; r++) {
+    float row[MAX_VARYINGS + 1];
+    varying_row(t, y + r, row);
+    std::uint64_t kept = 0;
+    for (std::uint64_t m = mask[r]; m; m &= m - 1) {
+      int i = std::countr_zero(m);
+      Varyings varyings;
+      interpolate_varyings(t, row, x0 + i, varyings);
+      std::pair<bool, TGAColor> fragment;
+      if constexpr (std::is_same_v<ShaderT, IShader>)
+        fragment = shader.fragment(varyings, t.primitive);
+      else
+        fragment = shader.ShaderT::fragment(varyings, t.primitive);
+      lanes++;
+      if (fragment.first) continue;
+      colors[r][i] = fragment.second;
+      kept |= 1ull << i;
+    }
+    mask[r] = kept;
+  }
+  return lanes;
+}
+
+inline QuadShader IShader::quad_shader(bool batched) const {
+  return batched ? shade_quads<IShader> : shade_pixels<IShader>;
+}
+
+// Distance from the eye to the near clipping plane.
+constexpr double NEAR_PLANE = 1e-2;
+// A triangle clipped by the near plane and the four guard-band planes has at
+// most 8 vertices, i.e. 6 triangles.
+constexpr int MAX_CLIPPED_TRIANGLES = 6;
+
+// Clips a triangle in homogeneous space and sets up the visible pieces.
+// Triangles crossing the near plane are always clipped; the side planes
+// only matter for triangles that leave the guard band. Returns the number
+// of triangles written to out.
+int setup_raster_triangles(const Triangle& clip, const Varyings varyings[3],
+                           const IShader& shader, int primitive,
+                           RasterTriangle* out);
+
+// Same, but the triangles are shaded through ShaderT's own fragment_quad()
+// whatever quad_shader() says; ShaderT = IShader forces virtual dispatch.
+template <class ShaderT>
+int setup_raster_triangles(const Triangle& clip, const Varyings varyings[3],
+                           const ShaderT& shader, int primitive,
+                           RasterTriangle* out) {
+  int n = setup_raster_triangles(clip, varyings, static_cast<const IShader&>(shader),
+                                 primitive, out);
+  for (int k = 0; k < n; k++) out[k].shade = shade_quads<ShaderT>;
+  return n;
+}
+
+// How rasterize_bins() runs the fragment shaders. Forward shades every
+// fragment that passes the depth test when it is drawn. DepthPrepass draws
+// each tile twice: depth only, then shading only the fragments whose depth
+// equals the final one. VisibilityBuffer records the nearest triangle of
+// every pixel and then shades each covered pixel exactly once. The last
+// two assume shaders do not discard.
+enum class ShadingMode { Forward, DepthPrepass, VisibilityBuffer };
+
+const char* shading_mode_name(ShadingMode mode);
+
+struct RasterStats {
+  std::uint64_t shader_invocations;  // covered fragments shaded
+  std::uint64_t helper_lanes;        // quad lanes shaded only for derivatives
+  std::uint64_t pixels_covered;      // pixels with a depth at the end
+  double raster_ms;                  // wall time of rasterize_bins()
+};
+
+// Sort-middle rendering. bin_triangles() sorts the set-up triangles into
+// per-tile lists that keep submission order; rasterize_bins() then gives
+// every tile to exactly one thread, which draws its list without locking.
+// The shaders must outlive rasterize_bins().
+void bin_triangles(const std::vector<RasterTriangle>& triangles);
+RasterStats rasterize_bins(const std::vector<RasterTriangle>& triangles,
+                           TGAImage& framebuffer,
+                           ShadingMode mode = ShadingMode::Forward);
\ No newline at end of file
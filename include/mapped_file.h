@@ -0,0 +1,40 @@
+#ifndef RASTERIZER_MAPPED_FILE_H
+#define RASTERIZER_MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A whole file mapped read-only, unmapped when it goes out of scope. bytes
+// is null if the file can't be opened or is empty. The mapping is not
+// terminated: parse [bytes, bytes + size) only.
+struct MappedFile {
+  const std::uint8_t* bytes = nullptr;
+  std::size_t size = 0;
+
+  explicit MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        bytes = static_cast<const std::uint8_t*>(map);
+        size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (bytes) munmap(const_cast<std::uint8_t*>(bytes), size);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+};
+
+#endif  // RASTERIZER_MAPPED_FILE_H
@@ -2,6 +2,7 @@
 #define RASTERIZER_MESH_H
 
 #include <vector>
+#include "texture.h"
 #include "tgaimage.h"
 #include "vec.h"
 
@@ -12,30 +13,64 @@ class Mesh {
   std::vector<int> face_normals = {};
   std::vector<vec2> uvs = {};
   std::vector<int> face_uvs = {};
-  TGAImage diffuse_map = {};
-  TGAImage normal_map = {};
-  TGAImage specular_map = {};
+  // Per-corner tangent frames: xyz is the tangent, w the sign of the
+  // bitangent, cross(normal, tangent) * w. Empty without uvs and normals.
+  std::vector<vec4> tangents = {};
+  std::vector<int> face_tangents = {};
+  Texture diffuse_map = {};
+  Texture normal_map = {};
+  Texture specular_map = {};
   bool has_texture = false;
   bool has_normal_map = false;
   bool has_specular_map = false;
 
+  void compute_tangents();
+
  public:
+  Mesh() = default;
   Mesh(const std::string filename);
   Mesh(std::vector<vec3> verts, std::vector<int> faces, std::vector<vec3> norms, std::vector<int> face_norms, std::vector<vec2> uvs = {}, std::vector<int> face_uvs = {});
   int nverts() const;
+  int nnormals() const;
   int nfaces() const;
   vec3 vertex(const int i) const;
   vec3 vertex(const int iface, const int nthvertex) const;
+  int vertex_index(const int iface, const int nthvertex) const;
+  vec3 normal(const int i) const;
   vec3 normal(const int iface, const int nthvertex) const;
+  int normal_index(const int iface, const int nthvertex) const;
+  bool hasTangents() const { return !tangents.empty(); }
+  int ntangents() const;
+  vec4 tangent(const int i) const;
+  int tangent_index(const int iface, const int nthvertex) const;
   vec2 uv(const int iface, const int nthvertex) const;
   void normalize();
+
+  // Binary snapshot of the geometry, tangents included, built from the
+  // file `source`. read_cache() fails, leaving the mesh as it was, when the
+  // cache is missing or broken, or when source's size changed, or its mtime
+  // changed along with its contents. A cache that outlived a touch of the
+  // source is updated to the new mtime.
+  bool read_cache(const std::string filename, const std::string source);
+  bool write_cache(const std::string filename, const std::string source) const;
   
-  void load_texture(const std::string filename);
-  void load_normal_map(const std::string filename);
-  void load_specular_map(const std::string filename);
-  TGAColor diffuse(vec2 uv) const;
+  // `compressed` stores the maps as BC1, BC5 and BC4 respectively: 4-8x
+  // less texture memory, decoded by the sampler. A baked .tex file (see
+  // tools/bake_texture.cpp) is mapped as is and must be in one of the two
+  // formats of its map.
+  void load_texture(const std::string filename, bool compressed = false);
+  void load_normal_map(const std::string filename, bool compressed = false);
+  void load_specular_map(const std::string filename, bool compressed = false);
+  // Diffuse colors are packed BGRA, B in the low byte.
+  std::uint32_t diffuse(vec2 uv) const;
   float specular(vec2 uv) const;
   vec3 normal(vec2 uv) const;
+  // Trilinear lookups for a fragment whose uv changes by duvdx and duvdy per
+  // pixel, e.g. FragmentQuad's derivatives of the uv varyings.
+  std::uint32_t diffuse(vec2 uv, vec2 duvdx, vec2 duvdy) const;
+  float specular(vec2 uv, vec2 duvdx, vec2 duvdy) const;
+  vec3 normal(vec2 uv, vec2 duvdx, vec2 duvdy) const;
+  bool hasTexture() const { return has_texture; }
   bool hasNormalMap() const { return has_normal_map; }
   bool hasSpecularMap() const { return has_specular_map; }
 };
@@ -0,0 +1,39 @@
+#ifndef RASTERIZER_RASTER_KERNEL_H
+#define RASTERIZER_RASTER_KERNEL_H
+
+#include <cstdint>
+
+// A run of up to 64 pixels on one scanline, prepared by rasterize_tile().
+// Edge values are pre-biased for the fill rule and scaled to whole pixels,
+// so a pixel is covered when all three are >= 0 and stepping them by `step`
+// is exact in 32 bits.
+struct RasterSpan {
+  std::int32_t e[3];
+  std::int32_t step[3];
+  float z, dzdx;  // depth of pixel i is z + dzdx * (x0 + i)
+  int x0;
+  int count;
+  const float* zbuffer;
+};
+
+// Coverage and depth test for a span. Bit i of the result is set when pixel
+// i is covered and closer than zbuffer[i]; its depth is written to depth[i].
+// The vector variants store whole registers, so depth must have room for
+// count rounded up to a multiple of 16 floats; zbuffer is only read within
+// count. Every variant returns bit-identical results.
+// The raster_depth_* kernels skip the edge tests and are used for spans the
+// triangle is known to cover completely.
+typedef std::uint64_t (*SpanKernel)(const RasterSpan& span, float* depth);
+
+std::uint64_t raster_span_scalar(const RasterSpan& span, float* depth);
+std::uint64_t raster_depth_scalar(const RasterSpan& span, float* depth);
+#ifdef RASTERIZER_X86_KERNELS
+std::uint64_t raster_span_sse41(const RasterSpan& span, float* depth);
+std::uint64_t raster_depth_sse41(const RasterSpan& span, float* depth);
+std::uint64_t raster_span_avx2(const RasterSpan& span, float* depth);
+std::uint64_t raster_depth_avx2(const RasterSpan& span, float* depth);
+std::uint64_t raster_span_avx512(const RasterSpan& span, float* depth);
+std::uint64_t raster_depth_avx512(const RasterSpan& span, float* depth);
+#endif
+
+#endif  // RASTERIZER_RASTER_KERNEL_H
@@ -2,8 +2,10 @@
 #define RASTERIZER_RENDERER_H
 
 #include <SDL2/SDL.h>
+#include <memory>
 #include <vector>
 #include <string>
+#include "frame_writer.h"
 #include "graphics.h"
 #include "mesh.h"
 #include "tgaimage.h"
@@ -29,6 +31,8 @@ public:
     // Mesh creation
     RenderObject* create_sphere(float radius, TGAColor color, int rings = 20, int sectors = 20);
     RenderObject* load_mesh(const std::string& filename, TGAColor color = {255, 255, 255, 255});
+    // Normalized mesh from an OBJ file, through its .rmesh cache
+    static Mesh read_mesh(const std::string& filename);
 
     // Time utils
     float get_delta_time() const { return dt; }
@@ -42,6 +46,21 @@ public:
     vec3 light_dir;
     float light_intensity = 1.0f;
 
+    // Rasterizer
+    ShadingMode shading_mode = ShadingMode::Forward;
+    DepthFormat depth_format = DepthFormat::F32;
+    bool inline_shaders = true; // false shades through IShader's virtual call
+    bool batch_shading = true;  // false calls fragment() per pixel, not per quad
+    RasterStats stats = {};  // of the last frame
+
+    // Frame dumps: each rendered frame goes to directory/frame_NNNNN.tga,
+    // written on a background thread. render() only waits while `queue`
+    // frames are pending.
+    void record_frames(const std::string& directory, std::size_t queue = 4);
+    void stop_recording();  // waits until the queued frames are written
+    bool recording() const { return frame_writer != nullptr; }
+    std::size_t frames_recorded() const { return frame_writer ? frame_writer->written() : 0; }
+
     // Debug UI
     bool physics_enabled = true;
     void add_ui_callback(std::function<void()> callback);
@@ -53,6 +72,10 @@ private:
     SDL_Texture* texture = nullptr;
     
     TGAImage framebuffer;
+
+    std::unique_ptr<FrameWriter> frame_writer;
+    std::string frame_directory;
+    int frame_index = 0;
     
     std::vector<RenderObject*> objects;
     
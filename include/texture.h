@@ -0,0 +1,121 @@
+#ifndef RASTERIZER_TEXTURE_H
+#define RASTERIZER_TEXTURE_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+#include "vec.h"
+
+// Layout a texture's texels are converted to at load time, so that samples
+// come out ready for the shader.
+enum class TexelFormat {
+  BGRA8,    // 32-bit color, B in the low byte; grayscale and RGB get A = 255
+  R8,       // single channel: channel 0 of the source image
+  NORMAL8,  // tangent-space normal decoded from RGB: x, y, z as signed bytes
+            // in [-127, 127] and a zero pad byte
+  // Block-compressed counterparts, 4x4 texels per block, decoded by the
+  // sampler. Each is encoded from the format in parentheses.
+  BC1,  // (BGRA8) two RGB565 endpoints, 2-bit indices: 8 bytes, A = 255
+  BC4,  // (R8) two 8-bit endpoints, 3-bit indices: 8 bytes
+  BC5,  // (NORMAL8) x and y as two signed BC4 blocks: 16 bytes; z is left
+        // to the caller, sqrt(1 - x^2 - y^2) for unit normals
+};
+
+// An image prepared for sampling: level 0 is the source image and every
+// further level halves it with a 2x2 box filter, down to 1x1. Texture
+// coordinates wrap around.
+//
+// Texels are stored in 4x4 blocks, one 64-byte cache line each for the
+// 32-bit formats and 8 or 16 bytes once compressed, so the 2x2 footprints
+// of bilinear filtering and the diagonal uv walks of a triangle touch few
+// lines. Unlike TGAImage, lookups are unchecked.
+//
+// write_baked() saves that layout, mips included, to a .tex file that
+// read_baked() maps into memory and samples in place. Texels are immutable
+// once built, so copies share them.
+class Texture {
+ public:
+  static constexpr int BLOCK_BITS = 2;
+  static constexpr int BLOCK_SIZE = 1 << BLOCK_BITS;
+
+  Texture() = default;
+  Texture(const TGAImage& image, TexelFormat format);
+
+  bool empty() const { return levels.empty(); }
+  TexelFormat format() const { return texel_format; }
+  bool compressed() const { return texel_format >= TexelFormat::BC1; }
+  int channels() const;
+  int width() const { return empty() ? 0 : levels[0].width; }
+  int height() const { return empty() ? 0 : levels[0].height; }
+  int nlevels() const { return levels.size(); }
+  std::size_t size_bytes() const { return data_size; }  // all levels
+
+  bool read_baked(const std::string filename);
+  bool write_baked(const std::string filename) const;
+
+  // Texel (x, y) of a level, both already inside the level: no checks. The
+  // bytes of the texel, the first one lowest; compressed formats decode to
+  // their source format's layout.
+  std::uint32_t texel(int level, int x, int y) const {
+    const Level& l = levels[level];
+    std::size_t block = (std::size_t)(y >> BLOCK_BITS) * l.blocks_w + (x >> BLOCK_BITS);
+    int i = ((y & (BLOCK_SIZE - 1)) << BLOCK_BITS) + (x & (BLOCK_SIZE - 1));
+    const std::uint8_t* p = &data[l.offset + block * block_bytes];
+    if (compressed()) return decode(p, i);
+    if (block_bytes == BLOCK_SIZE * BLOCK_SIZE) return p[i];
+    std::uint32_t t;
+    std::memcpy(&t, p + i * sizeof(t), sizeof(t));
+    return t;
+  }
+
+  // Level of detail of a pixel footprint whose uv changes by duvdx and duvdy
+  // per pixel: log2 of its longer side, in texels of level 0.
+  float lod(vec2 duvdx, vec2 duvdy) const;
+  // Nearest texel of level 0.
+  std::uint32_t sample(vec2 uv) const;
+  // Trilinear: bilinear in the two levels around lod, blended linearly.
+  // Below lod 0 this is bilinear in level 0. Writes channels() values in
+  // the units of the format: [0, 255], or [-127, 127] for normals.
+  void sample(vec2 uv, float lod, float* out) const;
+  void sample(vec2 uv, vec2 duvdx, vec2 duvdy, float* out) const {
+    sample(uv, lod(duvdx, duvdy), out);
+  }
+
+ private:
+  struct Level {
+    int width, height;
+    int blocks_w;        // blocks per block row
+    std::size_t offset;  // of the first block, in bytes
+  };
+  std::vector<Level> levels;
+  // Blocks of all levels, in a heap buffer or a mapped baked file; `storage`
+  // owns either.
+  std::shared_ptr<const std::uint8_t> storage;
+  const std::uint8_t* data = nullptr;
+  std::size_t data_size = 0;
+  TexelFormat texel_format = TexelFormat::BGRA8;
+  int block_bytes = 64;
+  bool pow2 = false;  // power-of-two sides: wrap with a mask
+
+  int wrap(int i, int n) const {
+    if (pow2) return i & (n - 1);
+    i %= n;
+    return i < 0 ? i + n : i;
+  }
+  int channel(std::uint32_t texel, int i) const {
+    int c = texel >> 8 * i & 255;
+    bool snorm = texel_format == TexelFormat::NORMAL8 || texel_format == TexelFormat::BC5;
+    return snorm ? (std::int8_t)c : c;
+  }
+  std::size_t layout(int w, int h);
+  std::uint8_t* allocate(int w, int h);
+  std::uint32_t decode(const std::uint8_t* block, int i) const;
+  void encode(const Texture& source, std::uint8_t* buffer);
+  void store(std::uint8_t* buffer, int level, int x, int y, std::uint32_t texel);
+  void bilinear(int level, vec2 uv, float weight, float* sum) const;
+};
+
+#endif  // RASTERIZER_TEXTURE_H
@@ -30,12 +30,16 @@ struct TGAImage {
   enum Format { GRAYSCALE = 1, RGB = 3, RGBA = 4 };
   TGAImage() = default;
   TGAImage(const int w, const int h, const int bpp);
-  bool read_tga_file(const std::string filename);
+  // The file is mapped and decoded straight into place, orientation
+  // included. vflip leaves the rows bottom to top, as write_tga_file's vflip
+  // stores them.
+  bool read_tga_file(const std::string filename, const bool vflip = false);
   bool write_tga_file(const std::string filename, const bool vflip = true,
                       const bool rle = true) const;
   void flip_horizontally();
   void flip_vertically();
   void clear();
+  void clear(const int x, const int y, const int w, const int h);  // a rectangle
   TGAColor get(const int x, const int y) const;
   void set(const int x, const int y, const TGAColor& c);
   int width() const;
@@ -43,8 +47,10 @@ struct TGAImage {
   std::uint8_t* buffer();
 
  private:
-  bool load_rle_data(std::ifstream& in);
-  bool unload_rle_data(std::ofstream& out) const;
+  // RLE packets of all pixels, and of pixels [begin, end) appended to out.
+  std::vector<std::uint8_t> rle_data() const;
+  void unload_rle_data(const std::size_t begin, const std::size_t end,
+                       std::vector<std::uint8_t>& out) const;
   int w = 0, h = 0;
   std::uint8_t bpp = 0;
   std::vector<std::uint8_t> data = {};
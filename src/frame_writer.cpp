@@ -0,0 +1,67 @@
+#include "frame_writer.h"
+
+#include <utility>
+
+FrameWriter::FrameWriter(std::size_t capacity)
+    : capacity(capacity ? capacity : 1), worker(&FrameWriter::run, this) {}
+
+FrameWriter::~FrameWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  not_empty.notify_one();
+  worker.join();
+}
+
+void FrameWriter::push(const TGAImage& frame, std::string filename, bool vflip) {
+  std::unique_lock<std::mutex> lock(mutex);
+  not_full.wait(lock, [&] { return queue.size() < capacity; });
+  TGAImage snapshot;
+  if (!spare.empty()) {
+    snapshot = std::move(spare.back());
+    spare.pop_back();
+  }
+  // Copying into a recycled image reuses its buffer. The copy happens under
+  // the lock, which the writer only holds briefly between frames.
+  snapshot = frame;
+  queue.push_back({std::move(snapshot), std::move(filename), vflip});
+  lock.unlock();
+  not_empty.notify_one();
+}
+
+void FrameWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [&] { return queue.empty() && !writing; });
+}
+
+std::size_t FrameWriter::written() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return frames_written;
+}
+
+std::size_t FrameWriter::failed() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return frames_failed;
+}
+
+void FrameWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    not_empty.wait(lock, [&] { return stopping || !queue.empty(); });
+    if (queue.empty()) return;  // stopping, and everything is written
+    Job job = std::move(queue.front());
+    queue.pop_front();
+    writing = true;
+    lock.unlock();
+    not_full.notify_one();
+
+    bool ok = job.frame.write_tga_file(job.filename, job.vflip, true);
+
+    lock.lock();
+    writing = false;
+    (ok ? frames_written : frames_failed)++;
+    spare.push_back(std::move(job.frame));
+    if (queue.empty()) idle.notify_all();
+  }
+}
@@ -1,21 +1,210 @@
 #include "graphics.h"
 
+#include <cmath>
 #include <cstdlib>
+#include <iostream>
 #include <limits>
 #include <algorithm>
+#include <bit>
+#include <chrono>
 #include <vector>
-#include <mutex>
-#include <memory>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "matrix.h"
+#include "raster_kernel.h"
 
 mat<4,4> ModelView, Viewport, Perspective;
+// Clip-space w of the near plane. With this projection w is the distance to
+// the eye divided by the focal length.
+double near_w = 1e-2;
+// Depth buffer, in the storage of the current format: zbuffer for F32,
+// zbuffer_d24 (depth in the low 24 bits, 8 spare bits above) and
+// zbuffer_d16 for the unorm formats.
+DepthFormat zbuffer_format = DepthFormat::F32;
 std::vector<float> zbuffer;
-std::vector<std::unique_ptr<std::mutex>> tile_mutexes;
+std::vector<std::uint32_t> zbuffer_d24;
+std::vector<std::uint16_t> zbuffer_d16;
+int zbuffer_width = 0;
+int zbuffer_height = 0;
+// Depth values are near_w / w scaled by depth_scale: [0, 1] for F32 and
+// [0, 2^bits - 1] for the unorm formats, whose stored value is the ceiling
+// of the fragment depth. A fragment passes when its float depth is greater
+// than the stored value, which for integers equals comparing the rounded-up
+// depth, so every format uses the same float kernels.
+double depth_scale = 1;
+const float DEPTH_CLEAR = 0;  // infinitely far
 const int TILE_SIZE = 64;
 int n_tiles_w = 0;
 int n_tiles_h = 0;
 
+// Tile t's triangles are bin_triangle_ids[bin_offsets[t] .. bin_offsets[t+1]),
+// in submission order.
+std::vector<std::uint32_t> bin_offsets;
+std::vector<std::uint32_t> bin_triangle_ids;
+// Per chunk and tile counters of bin_triangles(), kept across frames.
+std::vector<std::uint32_t> bin_cursor;
+
+// Visibility buffer: index of the triangle that owns each pixel, or
+// NO_TRIANGLE. Only kept up to date in ShadingMode::VisibilityBuffer.
+std::vector<std::uint32_t> vbuffer;
+const std::uint32_t NO_TRIANGLE = ~std::uint32_t(0);
+
+// Depth-prepass shading threshold: the float just below the final depth of
+// each pixel, raised to the final depth once the pixel has been shaded. The
+// span kernels' "closer than" test against it is an equal-depth test that
+// accepts a single fragment per pixel.
+std::vector<float> shade_zbuffer;
+
+// What rasterize_tile() does with a fragment that passes the depth test.
+enum FragmentOp {
+  FRAGMENT_SHADE,        // shade it, write depth and color
+  FRAGMENT_DEPTH,        // write depth only
+  FRAGMENT_ID,           // write depth and the triangle id to the vbuffer
+  FRAGMENT_SHADE_EQUAL,  // shade it if it is at the prepass depth
+};
+
+static_assert(TILE_SIZE <= 64, "a tile row must fit in one span mask");
+// Edge values handed to the span kernels are clamped to +-EDGE_CLAMP: a span
+// moves an edge by at most TILE_SIZE * 2^23, so the sign of every pixel is
+// preserved and the 32-bit lanes never overflow.
+const std::int64_t EDGE_CLAMP = std::int64_t(1) << 30;
+
+// Tiles are traversed in BLOCK_SIZE x BLOCK_SIZE blocks that are classified
+// against the triangle before any pixel is touched.
+const int BLOCK_SIZE = 8;
+// BLOCK_VISIBLE is an inside block in front of everything the z-buffer holds
+// there, so its pixels need no depth test either.
+enum BlockCoverage { BLOCK_OUTSIDE, BLOCK_PARTIAL, BLOCK_INSIDE, BLOCK_VISIBLE };
+
+// Hierarchical z-buffer: depth bounds of every block and every tile. Writes
+// only mark entries dirty; a dirty entry is recomputed from the level below
+// the next time a triangle is tested against it. Blocks and tiles belong to
+// a single tile, so the worker that owns the tile owns its entries too.
+struct DepthBounds {
+  float zmin, zmax;
+  bool dirty;
+};
+std::vector<DepthBounds> hiz_blocks;
+std::vector<DepthBounds> hiz_tiles;
+int n_blocks_w = 0;
+int n_blocks_h = 0;
+
+// Lazy clear state of every tile. clear_buffers() only advances
+// clear_generation; a tile whose generation is behind is reset when it is
+// first drawn to.
+struct TileClear {
+  std::uint32_t generation;
+  bool has_content;  // drawn to since it was last reset
+};
+std::vector<TileClear> tile_clears;
+std::uint32_t clear_generation = 0;
+
+static_assert(TILE_SIZE * (std::int64_t(2 * MAX_SCREEN_COORD) << SUBPIXEL_BITS) + EDGE_CLAMP <
+                  (std::int64_t(1) << 31),
+              "edge steps must not overflow the span kernels' 32-bit lanes");
+
+// Screen range [lo, hi] of one axis inside which triangles are rasterized
+// without clipping against the side planes: MAX_SCREEN_COORD - extent pixels
+// on either side of the viewport center, kept on the framebuffer. With
+// extent <= MAX_FRAMEBUFFER_SIZE this covers [0, extent] and stays inside
+// +-MAX_SCREEN_COORD; the pixel of margin absorbs clipping round-off.
+static void guard_band(double center, int extent, double& lo, double& hi) {
+  double c = std::clamp(center, 0., (double)extent);
+  double half = MAX_SCREEN_COORD - extent - 1;
+  lo = c - half;
+  hi = c + half;
+}
+
+template <bool test_edges>
+static std::uint64_t span_scalar(const RasterSpan& span, float* depth) {
+  std::uint64_t mask = 0;
+  std::int32_t e0 = span.e[0], e1 = span.e[1], e2 = span.e[2];
+  for (int i = 0; i < span.count;
+       i++, e0 += span.step[0], e1 += span.step[1], e2 += span.step[2]) {
+    float z = span.z + span.dzdx * (float)(span.x0 + i);
+    depth[i] = z;
+    if (test_edges && (e0 | e1 | e2) < 0) continue;
+    if (z > span.zbuffer[i]) mask |= 1ull << i;
+  }
+  return mask;
+}
+
+std::uint64_t raster_span_scalar(const RasterSpan& span, float* depth) {
+  return span_scalar<true>(span, depth);
+}
+
+std::uint64_t raster_depth_scalar(const RasterSpan& span, float* depth) {
+  return span_scalar<false>(span, depth);
+}
+
+bool raster_isa_supported(RasterIsa isa) {
+#ifdef RASTERIZER_X86_KERNELS
+  __builtin_cpu_init();
+  switch (isa) {
+    case RasterIsa::SSE41: return __builtin_cpu_supports("sse4.1");
+    case RasterIsa::AVX2: return __builtin_cpu_supports("avx2");
+    case RasterIsa::AVX512: return __builtin_cpu_supports("avx512f");
+    default: break;
+  }
+#endif
+  return isa == RasterIsa::Scalar;
+}
+
+struct SpanKernels {
+  SpanKernel edges;  // partially covered spans
+  SpanKernel depth;  // fully covered spans
+};
+
+static SpanKernels span_kernels_for([[maybe_unused]] RasterIsa isa) {
+#ifdef RASTERIZER_X86_KERNELS
+  switch (isa) {
+    case RasterIsa::SSE41: return {raster_span_sse41, raster_depth_sse41};
+    case RasterIsa::AVX2: return {raster_span_avx2, raster_depth_avx2};
+    case RasterIsa::AVX512: return {raster_span_avx512, raster_depth_avx512};
+    default: break;
+  }
+#endif
+  return {raster_span_scalar, raster_depth_scalar};
+}
+
+static RasterIsa best_raster_isa() {
+  for (RasterIsa isa : {RasterIsa::AVX512, RasterIsa::AVX2, RasterIsa::SSE41})
+    if (raster_isa_supported(isa)) return isa;
+  return RasterIsa::Scalar;
+}
+
+RasterIsa current_isa = best_raster_isa();
+SpanKernels span_kernels = span_kernels_for(current_isa);
+
+RasterIsa raster_isa() { return current_isa; }
+
+bool set_raster_isa(RasterIsa isa) {
+  if (!raster_isa_supported(isa)) return false;
+  current_isa = isa;
+  span_kernels = span_kernels_for(isa);
+  return true;
+}
+
+const char* raster_isa_name(RasterIsa isa) {
+  switch (isa) {
+    case RasterIsa::SSE41: return "SSE4.1";
+    case RasterIsa::AVX2: return "AVX2";
+    case RasterIsa::AVX512: return "AVX-512";
+    default: return "Scalar";
+  }
+}
+
+const char* shading_mode_name(ShadingMode mode) {
+  switch (mode) {
+    case ShadingMode::DepthPrepass: return "Depth Prepass";
+    case ShadingMode::VisibilityBuffer: return "Visibility Buffer";
+    default: return "Forward";
+  }
+}
+
 void lookat(const vec3 eye, const vec3 center, const vec3 up) {
   vec3 n = normalize(eye - center);
   vec3 l = normalize(cross(up, n));
@@ -32,88 +221,697 @@ void lookat(const vec3 eye, const vec3 center, const vec3 up) {
 
 void init_perspective(const double f) {
   double d = (f < 1e-6) ? 1e-6 : f;
+  near_w = NEAR_PLANE / d;
   Perspective = {
       {{1 / d, 0, 0, 0}, {0, 1 / d, 0, 0}, {0, 0, 1, 0}, {0, 0, -1 / d, 1}}};
 }
 
-void init_viewport(const int x, const int y, const int w, const int h) {
+bool init_viewport(const int x, const int y, const int w, const int h) {
+  if (w <= 0 || h <= 0 || w > MAX_FRAMEBUFFER_SIZE || h > MAX_FRAMEBUFFER_SIZE ||
+      std::abs(x) > MAX_FRAMEBUFFER_SIZE || std::abs(y) > MAX_FRAMEBUFFER_SIZE) {
+    std::cerr << "viewport " << w << "x" << h << "+" << x << "+" << y
+              << " out of range: sides and offsets are limited to " << MAX_FRAMEBUFFER_SIZE << "\n";
+    return false;
+  }
   Viewport = {{{w / 2., 0, 0, x + w / 2.},
                {0, h / 2., 0, y + h / 2.},
                {0, 0, 1, 0},
                {0, 0, 0, 1}}};
+  return true;
 }
 
-void init_zbuffer(const int width, const int height) {
-  zbuffer =
-      std::vector<float>(width * height, -std::numeric_limits<float>::max());
+bool init_zbuffer(const int width, const int height, DepthFormat format) {
+  if (width <= 0 || height <= 0 || width > MAX_FRAMEBUFFER_SIZE || height > MAX_FRAMEBUFFER_SIZE) {
+    std::cerr << "framebuffer " << width << "x" << height << " out of range: sides are limited to "
+              << MAX_FRAMEBUFFER_SIZE << "\n";
+    return false;
+  }
+  const float empty = DEPTH_CLEAR;
+  zbuffer_format = format;
+  zbuffer = {};
+  zbuffer_d24 = {};
+  zbuffer_d16 = {};
+  switch (format) {
+    case DepthFormat::F32:
+      zbuffer.assign(width * height, empty);
+      depth_scale = 1;
+      break;
+    case DepthFormat::D24:
+      zbuffer_d24.assign(width * height, 0);
+      depth_scale = 0xFFFFFF;
+      break;
+    case DepthFormat::D16:
+      zbuffer_d16.assign(width * height, 0);
+      depth_scale = 0xFFFF;
+      break;
+  }
+  zbuffer_width = width;
+  zbuffer_height = height;
+  n_tiles_w = (width + TILE_SIZE - 1) / TILE_SIZE;
+  n_tiles_h = (height + TILE_SIZE - 1) / TILE_SIZE;
+  n_blocks_w = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  n_blocks_h = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  hiz_blocks.assign(n_blocks_w * n_blocks_h, {empty, empty, false});
+  hiz_tiles.assign(n_tiles_w * n_tiles_h, {empty, empty, false});
+  // The framebuffer may still hold an image of the previous size or format,
+  // so every tile is reset when first drawn to.
+  tile_clears.assign(n_tiles_w * n_tiles_h, {clear_generation - 1, true});
+  return true;
+}
+
+DepthFormat depth_format() { return zbuffer_format; }
+
+const char* depth_format_name(DepthFormat format) {
+  switch (format) {
+    case DepthFormat::D24: return "D24";
+    case DepthFormat::D16: return "D16";
+    default: return "F32";
+  }
+}
 
-  int new_n_tiles_w = (width + TILE_SIZE - 1) / TILE_SIZE;
-  int new_n_tiles_h = (height + TILE_SIZE - 1) / TILE_SIZE;
+// Stored depth of pixel i, in the scaled float space of the kernels.
+static float depth_at(int i) {
+  switch (zbuffer_format) {
+    case DepthFormat::D24: return (float)(zbuffer_d24[i] & 0xFFFFFF);
+    case DepthFormat::D16: return (float)zbuffer_d16[i];
+    default: return zbuffer[i];
+  }
+}
 
-  if (new_n_tiles_w * new_n_tiles_h != (int)tile_mutexes.size()) {
-    n_tiles_w = new_n_tiles_w;
-    n_tiles_h = new_n_tiles_h;
-    tile_mutexes.clear();
-    tile_mutexes.reserve(n_tiles_w * n_tiles_h);
-    for (int i = 0; i < n_tiles_w * n_tiles_h; ++i) {
-      tile_mutexes.push_back(std::make_unique<std::mutex>());
+// Stored depths of pixels [i, i + n) for a span kernel: a pointer into the
+// F32 buffer, or the unorm values converted into tmp.
+static const float* depth_row(int i, int n, float* tmp) {
+  switch (zbuffer_format) {
+    case DepthFormat::D24:
+      for (int k = 0; k < n; k++) tmp[k] = (float)(zbuffer_d24[i + k] & 0xFFFFFF);
+      return tmp;
+    case DepthFormat::D16:
+      for (int k = 0; k < n; k++) tmp[k] = (float)zbuffer_d16[i + k];
+      return tmp;
+    default:
+      return &zbuffer[i];
+  }
+}
+
+// Stores fragment depth z at pixel i and returns the value now stored.
+static float store_depth(int i, float z) {
+  switch (zbuffer_format) {
+    case DepthFormat::D24: {
+      std::uint32_t d = (std::uint32_t)std::min(std::ceil(z), (float)0xFFFFFF);
+      zbuffer_d24[i] = (zbuffer_d24[i] & 0xFF000000) | d;
+      return (float)d;
+    }
+    case DepthFormat::D16: {
+      std::uint16_t d = (std::uint16_t)std::min(std::ceil(z), (float)0xFFFF);
+      zbuffer_d16[i] = d;
+      return (float)d;
     }
+    default:
+      zbuffer[i] = z;
+      return z;
+  }
+}
+
+// Largest value a fragment depth must exceed to round to stored depth z.
+static float depth_below(float z) {
+  if (zbuffer_format == DepthFormat::F32)
+    return std::nextafter(z, -std::numeric_limits<float>::infinity());
+  return z - 1;
+}
+
+static void fill_depth(int i, int n) {
+  switch (zbuffer_format) {
+    case DepthFormat::D24:
+      for (int k = i; k < i + n; k++) zbuffer_d24[k] &= 0xFF000000;
+      break;
+    case DepthFormat::D16:
+      std::fill_n(&zbuffer_d16[i], n, 0);
+      break;
+    default:
+      std::fill_n(&zbuffer[i], n, DEPTH_CLEAR);
+  }
+}
+
+void clear_buffers() {
+  clear_generation++;
+}
+
+// Performs the pending clear of tile (tx, ty), if any. Called by the thread
+// that owns the tile before it draws there.
+static void begin_tile(int tx, int ty, TGAImage& framebuffer) {
+  TileClear& clear = tile_clears[ty * n_tiles_w + tx];
+  if (clear.generation == clear_generation) return;
+  clear.generation = clear_generation;
+  if (!clear.has_content) return;
+  clear.has_content = false;
+
+  int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, zbuffer_width);
+  int y0 = ty * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, zbuffer_height);
+  for (int y = y0; y < y1; y++) fill_depth(x0 + y * zbuffer_width, x1 - x0);
+  framebuffer.clear(x0, framebuffer.height() - y1, x1 - x0, y1 - y0);
+
+  const int blocks = TILE_SIZE / BLOCK_SIZE;
+  for (int by = ty * blocks; by < std::min((ty + 1) * blocks, n_blocks_h); by++)
+    for (int bx = tx * blocks; bx < std::min((tx + 1) * blocks, n_blocks_w); bx++)
+      hiz_blocks[by * n_blocks_w + bx] = {DEPTH_CLEAR, DEPTH_CLEAR, false};
+  hiz_tiles[ty * n_tiles_w + tx] = {DEPTH_CLEAR, DEPTH_CLEAR, false};
+}
+
+static const DepthBounds& block_bounds(int bx, int by) {
+  DepthBounds& b = hiz_blocks[by * n_blocks_w + bx];
+  if (b.dirty) {
+    b = {std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), false};
+    int x_end = std::min((bx + 1) * BLOCK_SIZE, zbuffer_width);
+    int y_end = std::min((by + 1) * BLOCK_SIZE, zbuffer_height);
+    for (int y = by * BLOCK_SIZE; y < y_end; y++)
+      for (int x = bx * BLOCK_SIZE; x < x_end; x++) {
+        float z = depth_at(x + y * zbuffer_width);
+        b.zmin = std::min(b.zmin, z);
+        b.zmax = std::max(b.zmax, z);
+      }
   }
+  return b;
 }
 
-void rasterize(const Triangle& clip, const IShader& shader,
-               TGAImage& framebuffer) {
-  vec4 ndc[3] = {clip[0] / clip[0].w(), clip[1] / clip[1].w(),
-                 clip[2] / clip[2].w()};
+static const DepthBounds& tile_bounds(int tx, int ty) {
+  DepthBounds& t = hiz_tiles[ty * n_tiles_w + tx];
+  if (t.dirty) {
+    t = {std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), false};
+    const int blocks = TILE_SIZE / BLOCK_SIZE;
+    int bx_end = std::min((tx + 1) * blocks, n_blocks_w);
+    int by_end = std::min((ty + 1) * blocks, n_blocks_h);
+    for (int by = ty * blocks; by < by_end; by++)
+      for (int bx = tx * blocks; bx < bx_end; bx++) {
+        const DepthBounds& b = block_bounds(bx, by);
+        t.zmin = std::min(t.zmin, b.zmin);
+        t.zmax = std::max(t.zmax, b.zmax);
+      }
+  }
+  return t;
+}
+
+// Span kernel for spans known to be covered and in front of the z-buffer:
+// only computes depths, with the same arithmetic as the other kernels.
+static std::uint64_t raster_fill(const RasterSpan& span, float* depth) {
+  for (int i = 0; i < span.count; i++)
+    depth[i] = span.z + span.dzdx * (float)(span.x0 + i);
+  return span.count < 64 ? (1ull << span.count) - 1 : ~0ull;
+}
+
+// Converts a triangle to fixed-point edge equations. Edge i is opposite vertex
+// i and is positive inside a counter-clockwise (front-facing) triangle; pixels
+// are sampled at their centers. Returns false for back-facing, degenerate and
+// out-of-range triangles.
+bool setup_triangle(const vec2 screen[3], TriangleSetup& s) {
+  std::int64_t vx[3], vy[3];
+  for (int i = 0; i < 3; i++) {
+    if (std::abs(screen[i].x()) > MAX_SCREEN_COORD ||
+        std::abs(screen[i].y()) > MAX_SCREEN_COORD)
+      return false;
+    vx[i] = std::llround(screen[i].x() * SUBPIXEL_ONE);
+    vy[i] = std::llround(screen[i].y() * SUBPIXEL_ONE);
+  }
+
+  std::int64_t area2 =
+      (vx[1] - vx[0]) * (vy[2] - vy[0]) - (vy[1] - vy[0]) * (vx[2] - vx[0]);
+  if (area2 <= 0) return false;
+
+  for (int i = 0; i < 3; i++) {
+    int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+    s.a[i] = vy[i1] - vy[i2];
+    s.b[i] = vx[i2] - vx[i1];
+    s.c[i] = vx[i1] * vy[i2] - vy[i1] * vx[i2];
+    // Top-left rule: pixels exactly on a top or left edge belong to the
+    // triangle, pixels on any other edge belong to its neighbour.
+    bool top_left = s.a[i] > 0 || (s.a[i] == 0 && s.b[i] < 0);
+    s.threshold[i] = top_left ? -1 : 0;
+  }
+  s.inv_area2 = 1. / area2;
+
+  // Pixel (x, y) is sampled at (x + 1/2, y + 1/2); arithmetic shifts round
+  // the sub-pixel bounds to the first and last covered pixel centers.
+  const std::int64_t half = SUBPIXEL_ONE / 2;
+  s.minx = (int)((std::min({vx[0], vx[1], vx[2]}) - half + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+  s.maxx = (int)((std::max({vx[0], vx[1], vx[2]}) - half) >> SUBPIXEL_BITS);
+  s.miny = (int)((std::min({vy[0], vy[1], vy[2]}) - half + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+  s.maxy = (int)((std::max({vy[0], vy[1], vy[2]}) - half) >> SUBPIXEL_BITS);
+  return s.minx <= s.maxx && s.miny <= s.maxy;
+}
+
+// Value of edge i at the center of pixel (x, y).
+static std::int64_t edge_at(const TriangleSetup& s, int i, int x, int y) {
+  std::int64_t px = ((std::int64_t)x << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+  std::int64_t py = ((std::int64_t)y << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+  return s.a[i] * px + s.b[i] * py + s.c[i];
+}
+
+// Classifies the size x size block whose lower-left pixel is (x, y). Edge
+// functions are linear, so their extremes over the block are at its corner
+// pixels.
+static BlockCoverage classify_block(const TriangleSetup& s, int x, int y,
+                                    int size = BLOCK_SIZE) {
+  const std::int64_t extent = (std::int64_t)(size - 1) * SUBPIXEL_ONE;
+  bool inside = true;
+  for (int i = 0; i < 3; i++) {
+    std::int64_t e = edge_at(s, i, x, y);
+    std::int64_t dx = s.a[i] * extent, dy = s.b[i] * extent;
+    std::int64_t e_max = e + std::max<std::int64_t>(dx, 0) + std::max<std::int64_t>(dy, 0);
+    std::int64_t e_min = e + std::min<std::int64_t>(dx, 0) + std::min<std::int64_t>(dy, 0);
+    if (e_max <= s.threshold[i]) return BLOCK_OUTSIDE;
+    if (e_min <= s.threshold[i]) inside = false;
+  }
+  return inside ? BLOCK_INSIDE : BLOCK_PARTIAL;
+}
+
+// A vertex of a polygon being clipped, with its barycentric coordinates in
+// the original triangle.
+struct ClipVertex {
+  vec4 pos;
+  vec3 bary;
+};
+
+// Plane in clip space; points with dot(n, pos) + d >= 0 are kept.
+struct ClipPlane {
+  vec4 n;
+  double d;
+};
+
+// Sutherland-Hodgman step: clips the convex polygon in[0..n) against one
+// plane into out and returns the new vertex count.
+static int clip_polygon(const ClipVertex* in, int n, const ClipPlane& plane,
+                        ClipVertex* out) {
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    const ClipVertex& a = in[i];
+    const ClipVertex& b = in[(i + 1) % n];
+    double da = dot(plane.n, a.pos) + plane.d;
+    double db = dot(plane.n, b.pos) + plane.d;
+    if (da >= 0) out[count++] = a;
+    if ((da >= 0) != (db >= 0)) {
+      double t = da / (da - db);
+      out[count++] = {a.pos + (b.pos - a.pos) * t, a.bary + (b.bary - a.bary) * t};
+    }
+  }
+  return count;
+}
+
+// Plane through the values f[i] at the vertices of a set-up triangle, in
+// pixels from (minx, miny).
+static void plane_equation(const TriangleSetup& s, const double f[3],
+                           double& c, double& dx, double& dy) {
+  c = dx = dy = 0;
+  for (int i = 0; i < 3; i++) {
+    dx += (double)(s.a[i] * SUBPIXEL_ONE) * f[i];
+    dy += (double)(s.b[i] * SUBPIXEL_ONE) * f[i];
+    c += (double)edge_at(s, i, s.minx, s.miny) * f[i];
+  }
+  dx *= s.inv_area2;
+  dy *= s.inv_area2;
+  c *= s.inv_area2;
+}
+
+// Projects a triangle that lies in front of the near plane and inside the
+// guard band, and builds its edge equations, depth plane and varying
+// planes. The varyings of the clipped vertices are interpolated from the
+// original ones with their barycentrics.
+static bool setup_projected(const ClipVertex v[3], const Varyings varyings[3],
+                            const IShader& shader, int primitive,
+                            RasterTriangle& t) {
+  vec4 ndc[3] = {v[0].pos / v[0].pos.w(), v[1].pos / v[1].pos.w(),
+                 v[2].pos / v[2].pos.w()};
   vec4 s0 = Viewport * ndc[0];
   vec4 s1 = Viewport * ndc[1];
   vec4 s2 = Viewport * ndc[2];
   vec2 screen[3] = {vec2(s0.x(), s0.y()), vec2(s1.x(), s1.y()),
                     vec2(s2.x(), s2.y())};
 
-  mat<3, 3> ABC = {{{screen[0].x(), screen[0].y(), 1.},
-                    {screen[1].x(), screen[1].y(), 1.},
-                    {screen[2].x(), screen[2].y(), 1.}}};
-  if (ABC.det() < 1) return;
-  mat<3, 3> ABC_inv_t = ABC.invert_transpose();
-  auto x_bounds = std::minmax({screen[0].x(), screen[1].x(), screen[2].x()});
-  auto y_bounds = std::minmax({screen[0].y(), screen[1].y(), screen[2].y()});
-  auto bbminx = x_bounds.first;
-  auto bbmaxx = x_bounds.second;
-  auto bbminy = y_bounds.first;
-  auto bbmaxy = y_bounds.second;
-
-  int min_tile_x = std::max(0, (int)bbminx / TILE_SIZE);
-  int max_tile_x = std::min(n_tiles_w - 1, (int)bbmaxx / TILE_SIZE);
-  int min_tile_y = std::max(0, (int)bbminy / TILE_SIZE);
-  int max_tile_y = std::min(n_tiles_h - 1, (int)bbmaxy / TILE_SIZE);
-
-  for (int ty = min_tile_y; ty <= max_tile_y; ty++) {
-    for (int tx = min_tile_x; tx <= max_tile_x; tx++) {
-      std::lock_guard<std::mutex> lock(*tile_mutexes[ty * n_tiles_w + tx]);
-
-      int x_start = std::max((int)bbminx, tx * TILE_SIZE);
-      int x_end = std::min({(int)bbmaxx, (tx + 1) * TILE_SIZE - 1, framebuffer.width() - 1});
-      int y_start = std::max((int)bbminy, ty * TILE_SIZE);
-      int y_end = std::min({(int)bbmaxy, (ty + 1) * TILE_SIZE - 1, framebuffer.height() - 1});
-
-      for (int y = y_start; y <= y_end; y++) {
-        for (int x = x_start; x <= x_end; x++) {
-          vec3 bc = ABC_inv_t *
-                    vec3{static_cast<double>(x), static_cast<double>(y), 1.};
-          if (bc.x() < 0 || bc.y() < 0 || bc.z() < 0) continue;
-          double z = dot(bc, vec3(ndc[0].z(), ndc[1].z(), ndc[2].z()));
-          if (z <= zbuffer[x + y * framebuffer.width()]) continue;
-
-          vec3 bc_clip = {bc.x() / clip[0].w(), bc.y() / clip[1].w(), bc.z() / clip[2].w()};
-          bc_clip = bc_clip / (bc_clip.x() + bc_clip.y() + bc_clip.z());
-
-          auto [discard, color] = shader.fragment(bc_clip);
-          if (discard) continue;
-          zbuffer[x + y * framebuffer.width()] = z;
-          framebuffer.set(x, framebuffer.height() - 1 - y, color);
+  t.shader = nullptr;
+  if (!setup_triangle(screen, t.setup)) return false;
+
+  // Depth plane z(x, y) = z0 + dzdx * (x - minx) + dzdy * (y - miny). 1 / w
+  // is affine in screen space, so near_w / w interpolates exactly.
+  const TriangleSetup& setup = t.setup;
+  double depth[3], inv_w[3];
+  for (int i = 0; i < 3; i++) {
+    inv_w[i] = 1 / v[i].pos.w();
+    depth[i] = near_w * inv_w[i] * depth_scale;
+  }
+  plane_equation(setup, depth, t.z0, t.dzdx, t.dzdy);
+
+  auto set_plane = [&](AttributePlane& plane, const double f[3]) {
+    double c, dx, dy;
+    plane_equation(setup, f, c, dx, dy);
+    plane = {(float)c, (float)dx, (float)dy};
+  };
+  set_plane(t.inv_w, inv_w);
+  t.nvaryings = shader.nvaryings;
+  for (int k = 0; k < shader.nvaryings; k++) {
+    double f[3];
+    for (int i = 0; i < 3; i++) {
+      const vec3& b = v[i].bary;
+      f[i] = (b.x() * varyings[0][k] + b.y() * varyings[1][k] + b.z() * varyings[2][k]) * inv_w[i];
+    }
+    set_plane(t.varyings[k], f);
+  }
+
+  // Depth range for the hierarchical z test, widened to cover the rounding
+  // of the per-pixel float depths.
+  auto [zmin, zmax] = std::minmax({depth[0], depth[1], depth[2]});
+  double margin = 1e-5 * (std::abs(zmin) + std::abs(zmax)) + 1e-30;
+  t.zmin = zmin - margin;
+  t.zmax = zmax + margin;
+  t.shader = &shader;
+  t.shade = shader.quad_shader(true);
+  t.primitive = primitive;
+  return true;
+}
+
+int setup_raster_triangles(const Triangle& clip, const Varyings varyings[3],
+                           const IShader& shader, int primitive,
+                           RasterTriangle* out) {
+  // Near plane and guard band in clip space: x_screen = sx * x / w + ox must
+  // stay within [lo, hi], i.e. (lo - ox) / sx * w <= x <= (hi - ox) / sx * w.
+  double xlo, xhi, ylo, yhi;
+  guard_band(Viewport[0][3], zbuffer_width, xlo, xhi);
+  guard_band(Viewport[1][3], zbuffer_height, ylo, yhi);
+  const ClipPlane planes[5] = {
+      {{0, 0, 0, 1}, -near_w},
+      {{1, 0, 0, (Viewport[0][3] - xlo) / Viewport[0][0]}, 0},
+      {{-1, 0, 0, (xhi - Viewport[0][3]) / Viewport[0][0]}, 0},
+      {{0, 1, 0, (Viewport[1][3] - ylo) / Viewport[1][1]}, 0},
+      {{0, -1, 0, (yhi - Viewport[1][3]) / Viewport[1][1]}, 0}};
+
+  ClipVertex poly[2][3 + 5];
+  int n = 3;
+  for (int i = 0; i < 3; i++) {
+    poly[0][i].pos = clip[i];
+    poly[0][i].bary = vec3{i == 0, i == 1, i == 2};
+  }
+
+  // Common case: every vertex is inside every plane and no clipping is
+  // needed. A triangle entirely outside one plane is dropped.
+  int cur = 0;
+  for (const ClipPlane& plane : planes) {
+    int inside = 0;
+    for (int i = 0; i < n; i++) inside += dot(plane.n, poly[cur][i].pos) + plane.d >= 0;
+    if (inside == 0) return 0;
+    if (inside == n) continue;
+    n = clip_polygon(poly[cur], n, plane, poly[1 - cur]);
+    cur = 1 - cur;
+    if (n < 3) return 0;
+  }
+
+  int count = 0;
+  for (int i = 1; i + 1 < n; i++) {
+    ClipVertex v[3] = {poly[cur][0], poly[cur][i], poly[cur][i + 1]};
+    if (setup_projected(v, varyings, shader, primitive, out[count])) count++;
+  }
+  return count;
+}
+
+// Range of tiles overlapped by a triangle's bounding box; empty when the
+// triangle is off screen.
+static void tile_range(const TriangleSetup& s, int& min_tx, int& max_tx,
+                       int& min_ty, int& max_ty) {
+  min_tx = std::max(0, s.minx / TILE_SIZE);
+  max_tx = std::min(n_tiles_w - 1, s.maxx / TILE_SIZE);
+  min_ty = std::max(0, s.miny / TILE_SIZE);
+  max_ty = std::min(n_tiles_h - 1, s.maxy / TILE_SIZE);
+  if (s.maxx < 0) max_tx = -1;
+  if (s.maxy < 0) max_ty = -1;
+}
+
+// Draws the part of triangle `id` that falls into tile (tx, ty), applying
+// `op` to the fragments that pass. Tiles never share pixels, so different
+// tiles can be drawn concurrently.
+static void rasterize_tile(const RasterTriangle& t, std::uint32_t id, int tx,
+                           int ty, FragmentOp op, TGAImage& framebuffer,
+                           std::uint64_t& invocations, std::uint64_t& helper_lanes,
+                           std::uint64_t& covered) {
+  const TriangleSetup& setup = t.setup;
+  const int width = framebuffer.width();
+
+  int x_start = std::max(setup.minx, tx * TILE_SIZE);
+  int x_end = std::min({setup.maxx, (tx + 1) * TILE_SIZE - 1, width - 1});
+  int y_start = std::max(setup.miny, ty * TILE_SIZE);
+  int y_end = std::min({setup.maxy, (ty + 1) * TILE_SIZE - 1, framebuffer.height() - 1});
+  if (x_start > x_end || y_start > y_end) return;
+  // The equal-depth pass accepts depths down to just below the stored ones.
+  auto hidden = [&](const DepthBounds& bounds) {
+    return t.zmax <= (op == FRAGMENT_SHADE_EQUAL ? depth_below(bounds.zmin) : bounds.zmin);
+  };
+  if (hidden(tile_bounds(tx, ty))) return;
+
+  // Runs the span kernel over pixels [x0, x1] of rows y and y + 1 (y even)
+  // that lie in [row_start, row_end], then shades the 2x2 quads that pass or
+  // records them. Masks and buffers start at the quad-aligned x.
+  auto raster_rows = [&](int x0, int x1, int y, int row_start, int row_end,
+                         SpanKernel kernel) {
+    const int qx0 = x0 & ~1, shift = x0 - qx0;
+    std::uint64_t mask[2] = {0, 0};
+    // Room for shift + count rounded up to a full vector (see RasterSpan).
+    float depth[2][64 + 16];
+    for (int r = 0; r < 2; r++) {
+      if (y + r < row_start || y + r > row_end) continue;
+      RasterSpan span;
+      for (int i = 0; i < 3; i++) {
+        // e > threshold  <=>  (e - threshold - 1) >> SUBPIXEL_BITS >= 0, and
+        // the shifted value steps by a[i] per pixel.
+        std::int64_t e = edge_at(setup, i, x0, y + r);
+        std::int64_t biased = (e - setup.threshold[i] - 1) >> SUBPIXEL_BITS;
+        span.e[i] = (std::int32_t)std::clamp(biased, -EDGE_CLAMP, EDGE_CLAMP);
+        span.step[i] = (std::int32_t)setup.a[i];
+      }
+      span.z = t.z0 + t.dzdy * (y + r - setup.miny);
+      span.dzdx = t.dzdx;
+      span.x0 = x0 - setup.minx;
+      span.count = x1 - x0 + 1;
+      float stored[64];
+      span.zbuffer = op == FRAGMENT_SHADE_EQUAL
+                         ? &shade_zbuffer[x0 + (y + r) * width]
+                         : depth_row(x0 + (y + r) * width, span.count, stored);
+      mask[r] = kernel(span, depth[r] + shift) << shift;
+    }
+
+    TGAColor colors[2][64];
+    bool shade = op == FRAGMENT_SHADE || op == FRAGMENT_SHADE_EQUAL;
+    if (shade && (mask[0] | mask[1])) {
+      int covered = std::popcount(mask[0]) + std::popcount(mask[1]);
+      invocations += covered;
+      helper_lanes += t.shade(t, qx0, y, mask, colors) - covered;
+    }
+    for (int r = 0; r < 2; r++) {
+      int first_written = -1, last_written = -1;
+      for (; mask[r]; mask[r] &= mask[r] - 1) {
+        int i = std::countr_zero(mask[r]);
+        int x = qx0 + i, p = x + (y + r) * width;
+        if (op == FRAGMENT_ID) {
+          vbuffer[p] = id;
+        } else if (shade) {
+          framebuffer.set(x, framebuffer.height() - 1 - (y + r), colors[r][i]);
+          if (op == FRAGMENT_SHADE_EQUAL) {
+            shade_zbuffer[p] = depth_at(p);
+            continue;  // the z-buffer already holds this depth
+          }
         }
+        covered += depth_at(p) == DEPTH_CLEAR;  // first fragment of this pixel
+        store_depth(p, depth[r][i]);
+        if (first_written < 0) first_written = x;
+        last_written = x;
+      }
+
+      if (first_written >= 0) {
+        for (int bx = first_written / BLOCK_SIZE; bx <= last_written / BLOCK_SIZE; bx++)
+          hiz_blocks[((y + r) / BLOCK_SIZE) * n_blocks_w + bx].dirty = true;
+        hiz_tiles[ty * n_tiles_w + tx].dirty = true;
+        tile_clears[ty * n_tiles_w + tx].has_content = true;
+      }
+    }
+  };
+
+  // Classify each block row against the edges and the hierarchical z, then
+  // rasterize runs of equally classified blocks scanline by scanline:
+  // outside and hidden runs are skipped, inside runs only get the depth test
+  // and visible runs no test at all.
+  int bx_start = x_start / BLOCK_SIZE, bx_end = x_end / BLOCK_SIZE;
+  for (int by = y_start / BLOCK_SIZE; by <= y_end / BLOCK_SIZE; by++) {
+    BlockCoverage coverage[TILE_SIZE / BLOCK_SIZE];
+    for (int bx = bx_start; bx <= bx_end; bx++) {
+      BlockCoverage c = classify_block(setup, bx * BLOCK_SIZE, by * BLOCK_SIZE);
+      if (c != BLOCK_OUTSIDE) {
+        const DepthBounds& bounds = block_bounds(bx, by);
+        if (hidden(bounds))
+          c = BLOCK_OUTSIDE;
+        else if (c == BLOCK_INSIDE && t.zmin > bounds.zmax && op != FRAGMENT_SHADE_EQUAL)
+          c = BLOCK_VISIBLE;
+      }
+      coverage[bx - bx_start] = c;
+    }
+
+    int row_start = std::max(y_start, by * BLOCK_SIZE);
+    int row_end = std::min(y_end, by * BLOCK_SIZE + BLOCK_SIZE - 1);
+    for (int bx = bx_start, run_end; bx <= bx_end; bx = run_end + 1) {
+      BlockCoverage c = coverage[bx - bx_start];
+      for (run_end = bx; run_end < bx_end && coverage[run_end + 1 - bx_start] == c; run_end++);
+      if (c == BLOCK_OUTSIDE) continue;
+
+      int x0 = std::max(x_start, bx * BLOCK_SIZE);
+      int x1 = std::min(x_end, run_end * BLOCK_SIZE + BLOCK_SIZE - 1);
+      SpanKernel kernel = c == BLOCK_VISIBLE  ? raster_fill
+                          : c == BLOCK_INSIDE ? span_kernels.depth
+                                              : span_kernels.edges;
+      for (int y = row_start & ~1; y <= row_end; y += 2)
+        raster_rows(x0, x1, y, row_start, row_end, kernel);
+    }
+  }
+}
+
+void bin_triangles(const std::vector<RasterTriangle>& triangles) {
+  const int n_tiles = n_tiles_w * n_tiles_h;
+  const int n = (int)triangles.size();
+
+  // Counting sort over contiguous chunks of triangles: chunk c's entries of a
+  // tile are placed after those of chunks 0..c-1, so every bin comes out in
+  // submission order without any locking. A few chunks per thread balance
+  // the load while keeping the per-tile counters independent of the
+  // triangle count.
+#ifdef _OPENMP
+  const int n_threads = omp_get_max_threads();
+#else
+  const int n_threads = 1;
+#endif
+  const int n_chunks = std::max(1, std::min(n, 4 * n_threads));
+  const int chunk_size = (n + n_chunks - 1) / n_chunks;
+  std::vector<std::uint32_t>& cursor = bin_cursor;
+  cursor.assign((std::size_t)n_chunks * n_tiles, 0);
+
+  // Calls f(tile) for every tile a triangle really overlaps.
+  auto for_each_tile = [](const RasterTriangle& t, auto&& f) {
+    if (!t.shader) return;
+    int min_tx, max_tx, min_ty, max_ty;
+    tile_range(t.setup, min_tx, max_tx, min_ty, max_ty);
+    for (int ty = min_ty; ty <= max_ty; ty++)
+      for (int tx = min_tx; tx <= max_tx; tx++)
+        if (classify_block(t.setup, tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE) != BLOCK_OUTSIDE)
+          f(ty * n_tiles_w + tx);
+  };
+
+  #pragma omp parallel for
+  for (int c = 0; c < n_chunks; c++) {
+    std::uint32_t* count = &cursor[(std::size_t)c * n_tiles];
+    for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++)
+      for_each_tile(triangles[i], [&](int tile) { count[tile]++; });
+  }
+
+  bin_offsets.assign(n_tiles + 1, 0);
+  std::uint32_t total = 0;
+  for (int tile = 0; tile < n_tiles; tile++) {
+    bin_offsets[tile] = total;
+    for (int c = 0; c < n_chunks; c++) {
+      std::uint32_t count = cursor[(std::size_t)c * n_tiles + tile];
+      cursor[(std::size_t)c * n_tiles + tile] = total;
+      total += count;
+    }
+  }
+  bin_offsets[n_tiles] = total;
+  bin_triangle_ids.resize(total);
+
+  #pragma omp parallel for
+  for (int c = 0; c < n_chunks; c++) {
+    std::uint32_t* next = &cursor[(std::size_t)c * n_tiles];
+    for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++)
+      for_each_tile(triangles[i], [&](int tile) { bin_triangle_ids[next[tile]++] = i; });
+  }
+}
+
+// Shades every pixel of tile (tx, ty) once, with the triangle the
+// visibility buffer holds for it. Rows are resolved in pairs: each pass
+// takes the first pending pixel's triangle and shades its pixels in the run
+// of quads that contain it, pixels of other triangles acting as helpers.
+static void resolve_tile(const std::vector<RasterTriangle>& triangles, int tx,
+                         int ty, TGAImage& framebuffer,
+                         std::uint64_t& invocations, std::uint64_t& helper_lanes) {
+  const int width = framebuffer.width(), height = framebuffer.height();
+  const int x0 = tx * TILE_SIZE;
+  const int n = std::min(TILE_SIZE, width - x0);
+  int y_end = std::min((ty + 1) * TILE_SIZE, height);
+  for (int y = ty * TILE_SIZE; y < y_end; y += 2) {
+    const std::uint32_t* ids[2] = {&vbuffer[x0 + y * width],
+                                   y + 1 < height ? &vbuffer[x0 + (y + 1) * width] : nullptr};
+    std::uint64_t pending[2] = {0, 0};
+    for (int r = 0; r < 2; r++)
+      for (int i = 0; ids[r] && i < n; i++)
+        if (ids[r][i] != NO_TRIANGLE) pending[r] |= 1ull << i;
+
+    while (pending[0] | pending[1]) {
+      int first = std::countr_zero(pending[0] | pending[1]);
+      std::uint32_t id = ids[(pending[0] >> first & 1) ? 0 : 1][first];
+      std::uint64_t mask[2] = {0, 0};
+      for (int q = first & ~1; q < n; q += 2) {
+        std::uint64_t quad[2] = {0, 0};
+        for (int r = 0; r < 2; r++)
+          for (int i = q; ids[r] && i < std::min(q + 2, n); i++)
+            if (ids[r][i] == id) quad[r] |= 1ull << i;
+        if (!(quad[0] | quad[1])) break;
+        mask[0] |= quad[0];
+        mask[1] |= quad[1];
       }
+      pending[0] &= ~mask[0];
+      pending[1] &= ~mask[1];
+
+      const RasterTriangle& t = triangles[id];
+      TGAColor colors[2][64];
+      int covered = std::popcount(mask[0]) + std::popcount(mask[1]);
+      invocations += covered;
+      helper_lanes += t.shade(t, x0, y, mask, colors) - covered;
+      for (int r = 0; r < 2; r++)
+        for (; mask[r]; mask[r] &= mask[r] - 1) {
+          int i = std::countr_zero(mask[r]);
+          framebuffer.set(x0 + i, height - 1 - (y + r), colors[r][i]);
+        }
     }
   }
-}
\ No newline at end of file
+}
+
+RasterStats rasterize_bins(const std::vector<RasterTriangle>& triangles,
+                           TGAImage& framebuffer, ShadingMode mode) {
+  const auto start = std::chrono::steady_clock::now();
+  const int n_tiles = n_tiles_w * n_tiles_h;
+  const int width = framebuffer.width();
+  if (mode == ShadingMode::VisibilityBuffer)
+    vbuffer.resize((std::size_t)width * framebuffer.height());
+  if (mode == ShadingMode::DepthPrepass)
+    shade_zbuffer.resize((std::size_t)width * framebuffer.height());
+  const FragmentOp op = mode == ShadingMode::VisibilityBuffer ? FRAGMENT_ID
+                        : mode == ShadingMode::DepthPrepass   ? FRAGMENT_DEPTH
+                                                              : FRAGMENT_SHADE;
+
+  std::uint64_t invocations = 0, helper_lanes = 0, covered = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+ : invocations, helper_lanes, covered)
+  for (int tile = 0; tile < n_tiles; tile++) {
+    int tx = tile % n_tiles_w, ty = tile / n_tiles_w;
+    int x_end = std::min((tx + 1) * TILE_SIZE, width);
+    int y_end = std::min((ty + 1) * TILE_SIZE, framebuffer.height());
+    begin_tile(tx, ty, framebuffer);
+    if (mode == ShadingMode::VisibilityBuffer)
+      for (int y = ty * TILE_SIZE; y < y_end; y++)
+        std::fill_n(&vbuffer[tx * TILE_SIZE + y * width], x_end - tx * TILE_SIZE, NO_TRIANGLE);
+
+    for (std::uint32_t k = bin_offsets[tile]; k < bin_offsets[tile + 1]; k++)
+      rasterize_tile(triangles[bin_triangle_ids[k]], bin_triangle_ids[k], tx, ty,
+                     op, framebuffer, invocations, helper_lanes, covered);
+    if (mode == ShadingMode::VisibilityBuffer)
+      resolve_tile(triangles, tx, ty, framebuffer, invocations, helper_lanes);
+
+    if (mode == ShadingMode::DepthPrepass) {
+      for (int y = ty * TILE_SIZE; y < y_end; y++)
+        for (int x = tx * TILE_SIZE; x < x_end; x++)
+          shade_zbuffer[x + y * width] = depth_below(depth_at(x + y * width));
+      for (std::uint32_t k = bin_offsets[tile]; k < bin_offsets[tile + 1]; k++)
+        rasterize_tile(triangles[bin_triangle_ids[k]], bin_triangle_ids[k], tx, ty,
+                       FRAGMENT_SHADE_EQUAL, framebuffer, invocations, helper_lanes, covered);
+    }
+  }
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  return {invocations, helper_lanes, covered, elapsed.count()};
+}
@@ -37,6 +37,14 @@ int main(int argc, char** argv) {
     Renderer renderer(800, 800);
     if (!renderer.init()) return 1;
 
+    // --dump-frames DIR writes every frame to DIR, e.g. for regression runs
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--dump-frames") {
+            fs::create_directories(argv[i + 1]);
+            renderer.record_frames(argv[i + 1]);
+        }
+    }
+
     std::vector<PhysicsObject> physics_objects;
     
     // Load floor
@@ -46,7 +54,11 @@ int main(int argc, char** argv) {
     floor->position = {0, -1.0f, 0};
 
     auto mesh_files = get_files("assets", ".obj");
+    // TGA images and textures baked from them, which load without decoding
     auto texture_files = get_files("assets", ".tga");
+    auto baked_files = get_files("assets", ".tex");
+    texture_files.insert(texture_files.end(), baked_files.begin(), baked_files.end());
+    std::sort(texture_files.begin(), texture_files.end());
     
     // Helper to find index
     auto find_index = [](const std::vector<std::string>& files, const std::string& name) {
@@ -63,6 +75,14 @@ int main(int argc, char** argv) {
     obj->mesh.load_texture("assets/african_head_diffuse.tga");
     obj->mesh.load_normal_map("assets/african_head_nm_tangent.tga");
     obj->mesh.load_specular_map("assets/african_head_spec.tga");
+    bool compress_textures = false;
+
+    auto load_textures = [&]() {
+        obj->mesh.load_texture("assets/" + texture_files[current_diffuse_idx], compress_textures);
+        obj->mesh.load_normal_map("assets/" + texture_files[current_nm_idx], compress_textures);
+        if (current_spec_idx >= 0 && current_spec_idx < (int)texture_files.size())
+            obj->mesh.load_specular_map("assets/" + texture_files[current_spec_idx], compress_textures);
+    };
 
     // UI Callback
     renderer.add_ui_callback([&]() {
@@ -71,6 +91,49 @@ int main(int argc, char** argv) {
         
         ImGui::Checkbox("Enable Physics", &renderer.physics_enabled);
 
+        ImGui::Separator();
+        ImGui::Text("Rasterizer");
+
+        if (ImGui::BeginCombo("Kernel", raster_isa_name(raster_isa()))) {
+            for (RasterIsa isa : {RasterIsa::Scalar, RasterIsa::SSE41, RasterIsa::AVX2, RasterIsa::AVX512}) {
+                if (!raster_isa_supported(isa)) continue;
+                bool is_selected = (raster_isa() == isa);
+                if (ImGui::Selectable(raster_isa_name(isa), is_selected)) set_raster_isa(isa);
+                if (is_selected) ImGui::SetItemDefaultFocus();
+            }
+            ImGui::EndCombo();
+        }
+
+        if (ImGui::BeginCombo("Shading", shading_mode_name(renderer.shading_mode))) {
+            for (ShadingMode mode : {ShadingMode::Forward, ShadingMode::DepthPrepass, ShadingMode::VisibilityBuffer}) {
+                bool is_selected = (renderer.shading_mode == mode);
+                if (ImGui::Selectable(shading_mode_name(mode), is_selected)) renderer.shading_mode = mode;
+                if (is_selected) ImGui::SetItemDefaultFocus();
+            }
+            ImGui::EndCombo();
+        }
+        if (ImGui::BeginCombo("Depth", depth_format_name(renderer.depth_format))) {
+            for (DepthFormat format : {DepthFormat::F32, DepthFormat::D24, DepthFormat::D16}) {
+                bool is_selected = (renderer.depth_format == format);
+                if (ImGui::Selectable(depth_format_name(format), is_selected)) renderer.depth_format = format;
+                if (is_selected) ImGui::SetItemDefaultFocus();
+            }
+            ImGui::EndCombo();
+        }
+        ImGui::Checkbox("Inline Shaders", &renderer.inline_shaders);
+        ImGui::Checkbox("Quad Shading", &renderer.batch_shading);
+        ImGui::Text("Raster time: %.2f ms (%s, %s)", renderer.stats.raster_ms,
+                    shading_mode_name(renderer.shading_mode),
+                    renderer.batch_shading ? "quads" : "per pixel");
+        ImGui::Text("Shader calls: %llu (%.2f per pixel)",
+                    (unsigned long long)renderer.stats.shader_invocations,
+                    renderer.stats.pixels_covered ? (double)renderer.stats.shader_invocations / renderer.stats.pixels_covered : 0.0);
+        ImGui::Text("Helper lanes: %llu (%.1f%% of lanes)",
+                    (unsigned long long)renderer.stats.helper_lanes,
+                    renderer.stats.shader_invocations ? 100.0 * renderer.stats.helper_lanes / (renderer.stats.shader_invocations + renderer.stats.helper_lanes) : 0.0);
+        if (renderer.recording())
+            ImGui::Text("Frames dumped: %zu", renderer.frames_recorded());
+
         ImGui::Separator();
         ImGui::Text("Lighting");
         
@@ -92,14 +155,9 @@ int main(int argc, char** argv) {
                     bool is_selected = (current_mesh_idx == n);
                     if (ImGui::Selectable(mesh_files[n].c_str(), is_selected)) {
                         current_mesh_idx = n;
-                        obj->mesh = Mesh("assets/" + mesh_files[current_mesh_idx]);
+                        obj->mesh = Renderer::read_mesh("assets/" + mesh_files[current_mesh_idx]);
                         // Re-apply textures
-                        if (!texture_files.empty()) {
-                             obj->mesh.load_texture("assets/" + texture_files[current_diffuse_idx]);
-                             obj->mesh.load_normal_map("assets/" + texture_files[current_nm_idx]);
-                             if (current_spec_idx >= 0 && current_spec_idx < texture_files.size())
-                                obj->mesh.load_specular_map("assets/" + texture_files[current_spec_idx]);
-                        }
+                        if (!texture_files.empty()) load_textures();
                     }
                     if (is_selected) ImGui::SetItemDefaultFocus();
                 }
@@ -108,12 +166,13 @@ int main(int argc, char** argv) {
         }
 
         if (!texture_files.empty()) {
+            if (ImGui::Checkbox("Compress Textures", &compress_textures)) load_textures();
             if (ImGui::BeginCombo("Diffuse Texture", texture_files[current_diffuse_idx].c_str())) {
                 for (int n = 0; n < texture_files.size(); n++) {
                     bool is_selected = (current_diffuse_idx == n);
                     if (ImGui::Selectable(texture_files[n].c_str(), is_selected)) {
                         current_diffuse_idx = n;
-                        obj->mesh.load_texture("assets/" + texture_files[current_diffuse_idx]);
+                        obj->mesh.load_texture("assets/" + texture_files[current_diffuse_idx], compress_textures);
                     }
                     if (is_selected) ImGui::SetItemDefaultFocus();
                 }
@@ -125,7 +184,7 @@ int main(int argc, char** argv) {
                     bool is_selected = (current_nm_idx == n);
                     if (ImGui::Selectable(texture_files[n].c_str(), is_selected)) {
                         current_nm_idx = n;
-                        obj->mesh.load_normal_map("assets/" + texture_files[current_nm_idx]);
+                        obj->mesh.load_normal_map("assets/" + texture_files[current_nm_idx], compress_textures);
                     }
                     if (is_selected) ImGui::SetItemDefaultFocus();
                 }
@@ -137,7 +196,7 @@ int main(int argc, char** argv) {
                     bool is_selected = (current_spec_idx == n);
                     if (ImGui::Selectable(texture_files[n].c_str(), is_selected)) {
                         current_spec_idx = n;
-                        obj->mesh.load_specular_map("assets/" + texture_files[current_spec_idx]);
+                        obj->mesh.load_specular_map("assets/" + texture_files[current_spec_idx], compress_textures);
                     }
                     if (is_selected) ImGui::SetItemDefaultFocus();
                 }
@@ -1,97 +1,317 @@
 #include "mesh.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <type_traits>
+#include <unordered_map>
+
+#include "mapped_file.h"
 
 Mesh::Mesh(std::vector<vec3> verts, std::vector<int> faces, std::vector<vec3> norms, std::vector<int> face_norms, std::vector<vec2> uvs, std::vector<int> face_uvs) 
-    : vertices(verts), face_vertices(faces), normals(norms), face_normals(face_norms), uvs(uvs), face_uvs(face_uvs) {}
+    : vertices(verts), face_vertices(faces), normals(norms), face_normals(face_norms), uvs(uvs), face_uvs(face_uvs) {
+  compute_tangents();
+}
 
-Mesh::Mesh(const std::string filename) {
-  std::ifstream in;
-  in.open(filename, std::ifstream::in);
-  if (in.fail()) return;
-  std::string line;
-  while (std::getline(in, line)) {
-    std::istringstream iss(line);
-    std::string prefix;
-    iss >> prefix;
-
-    if (prefix == "v") {
+namespace {
+
+// Vertex data and faces of a run of whole lines of an OBJ file. Positive
+// indices are global and already 0-based. Negative ones are resolved
+// against the chunk's own counts and listed in relative_*, so the merge can
+// add the counts of the chunks before it.
+struct ObjChunk {
+  std::vector<vec3> vertices, normals;
+  std::vector<vec2> uvs;
+  std::vector<int> face_vertices, face_normals, face_uvs;
+  std::vector<std::size_t> relative_vertices, relative_normals, relative_uvs;
+};
+
+bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+const char* skip_blanks(const char* p, const char* end) {
+  while (p < end && is_blank(*p)) p++;
+  return p;
+}
+
+// Parses a number at p, after blanks, and moves p past it. A missing or
+// malformed number reads as 0, as with operator>>.
+double parse_double(const char*& p, const char* end) {
+  p = skip_blanks(p, end);
+  if (p < end && *p == '+') p++;
+  double value = 0;
+#if defined(__cpp_lib_to_chars)
+  auto [next, ec] = std::from_chars(p, end, value);
+  if (ec == std::errc()) p = next;
+#else
+  // No floating-point from_chars: strtod on a terminated copy of the token.
+  char token[64];
+  std::size_t n = 0;
+  while (p + n < end && n + 1 < sizeof(token) && !is_blank(p[n]) && p[n] != '\n') {
+    token[n] = p[n];
+    n++;
+  }
+  token[n] = '\0';
+  char* next = token;
+  value = std::strtod(token, &next);
+  p += next - token;
+#endif
+  return value;
+}
+
+int parse_int(const char*& p, const char* end) {
+  if (p < end && *p == '+') p++;
+  int value = 0;
+  auto [next, ec] = std::from_chars(p, end, value);
+  if (ec == std::errc()) p = next;
+  return value;
+}
+
+// A face corner's index: 0-based, and whether it counts from the end.
+struct ObjIndex {
+  int index;
+  bool relative;
+};
+
+// Converts a 1-based OBJ index, negative from the end of `count` elements.
+ObjIndex obj_index(int i, std::size_t count) {
+  if (i < 0) return {(int)count + i, true};
+  return {i - 1, false};
+}
+
+void push_corner(ObjIndex i, std::vector<int>& face, std::vector<std::size_t>& relative) {
+  if (i.relative) relative.push_back(face.size());
+  face.push_back(i.index);
+}
+
+void parse_obj_lines(const char* p, const char* end, ObjChunk& chunk) {
+  std::vector<ObjIndex> corners, corner_normals, corner_uvs;  // of one face
+  while (p < end) {
+    const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (!line_end) line_end = end;
+    p = skip_blanks(p, line_end);
+    const char* keyword = p;
+    while (p < line_end && !is_blank(*p)) p++;
+    std::size_t length = p - keyword;
+
+    if (length == 1 && keyword[0] == 'v') {
       vec3 v;
-      iss >> v[0] >> v[1] >> v[2];
-      vertices.push_back(v);
-    } else if (prefix == "vn") {
+      for (int i = 0; i < 3; i++) v[i] = parse_double(p, line_end);
+      chunk.vertices.push_back(v);
+    } else if (length == 2 && keyword[0] == 'v' && keyword[1] == 'n') {
       vec3 n;
-      iss >> n[0] >> n[1] >> n[2];
-      normals.push_back(n);
-    } else if (prefix == "vt") {
+      for (int i = 0; i < 3; i++) n[i] = parse_double(p, line_end);
+      chunk.normals.push_back(n);
+    } else if (length == 2 && keyword[0] == 'v' && keyword[1] == 't') {
       vec2 uv;
-      iss >> uv[0] >> uv[1];
-      uvs.push_back(uv);
-    } else if (prefix == "f") {
-      std::string vertex_data;
-      std::vector<int> face_indices;
-      std::vector<int> face_normal_indices;
-      std::vector<int> face_uv_indices;
-
-      while (iss >> vertex_data) {
-        int v_idx = 0;
-        int vn_idx = 0;
-        int vt_idx = 0;
-        // Parse the vertex index (before first '/' or entire string)
-        size_t slash_pos = vertex_data.find('/');
-        if (slash_pos == std::string::npos) {
-          v_idx = std::stoi(vertex_data);
-        } else {
-          v_idx = std::stoi(vertex_data.substr(0, slash_pos));
-          size_t second_slash = vertex_data.find('/', slash_pos + 1);
-          if (second_slash != std::string::npos) {
-            std::string vt_part = vertex_data.substr(slash_pos + 1, second_slash - slash_pos - 1);
-            if (!vt_part.empty()) vt_idx = std::stoi(vt_part);
-            
-            std::string vn_part = vertex_data.substr(second_slash + 1);
-            if (!vn_part.empty()) vn_idx = std::stoi(vn_part);
-          } else {
-             std::string vt_part = vertex_data.substr(slash_pos + 1);
-             if (!vt_part.empty()) vt_idx = std::stoi(vt_part);
+      for (int i = 0; i < 2; i++) uv[i] = parse_double(p, line_end);
+      chunk.uvs.push_back(uv);
+    } else if (length == 1 && keyword[0] == 'f') {
+      corners.clear();
+      corner_normals.clear();
+      corner_uvs.clear();
+      // Corners are v, v/vt, v//vn or v/vt/vn; an index of 0 is absent.
+      while ((p = skip_blanks(p, line_end)) < line_end) {
+        int v = parse_int(p, line_end), vt = 0, vn = 0;
+        if (p < line_end && *p == '/') {
+          p++;
+          if (p < line_end && *p != '/') vt = parse_int(p, line_end);
+          if (p < line_end && *p == '/') {
+            p++;
+            vn = parse_int(p, line_end);
           }
         }
-        // OBJ indices are 1-based, convert to 0-based
-        // Handle negative indices (relative to end)
-        if (v_idx < 0) v_idx = vertices.size() + v_idx + 1;
-        face_indices.push_back(v_idx - 1);
-
-        if (vn_idx != 0) {
-          if (vn_idx < 0) vn_idx = normals.size() + vn_idx + 1;
-          face_normal_indices.push_back(vn_idx - 1);
-        }
-        
-        if (vt_idx != 0) {
-            if (vt_idx < 0) vt_idx = uvs.size() + vt_idx + 1;
-            face_uv_indices.push_back(vt_idx - 1);
-        }
+        while (p < line_end && !is_blank(*p)) p++;  // rest of a malformed corner
+        corners.push_back(obj_index(v, chunk.vertices.size()));
+        if (vn != 0) corner_normals.push_back(obj_index(vn, chunk.normals.size()));
+        if (vt != 0) corner_uvs.push_back(obj_index(vt, chunk.uvs.size()));
       }
 
       // Triangulate faces with more than 3 vertices (fan triangulation)
-      for (size_t i = 1; i + 1 < face_indices.size(); i++) {
-        face_vertices.push_back(face_indices[0]);
-        face_vertices.push_back(face_indices[i]);
-        face_vertices.push_back(face_indices[i + 1]);
-
-        if (!face_normal_indices.empty()) {
-          face_normals.push_back(face_normal_indices[0]);
-          face_normals.push_back(face_normal_indices[i]);
-          face_normals.push_back(face_normal_indices[i + 1]);
-        }
-        
-        if (!face_uv_indices.empty()) {
-            face_uvs.push_back(face_uv_indices[0]);
-            face_uvs.push_back(face_uv_indices[i]);
-            face_uvs.push_back(face_uv_indices[i + 1]);
+      for (size_t i = 1; i + 1 < corners.size(); i++) {
+        for (size_t c : {(size_t)0, i, i + 1}) {
+          push_corner(corners[c], chunk.face_vertices, chunk.relative_vertices);
+          if (!corner_normals.empty())
+            push_corner(corner_normals[c], chunk.face_normals, chunk.relative_normals);
+          if (!corner_uvs.empty())
+            push_corner(corner_uvs[c], chunk.face_uvs, chunk.relative_uvs);
         }
       }
     }
+    p = line_end < end ? line_end + 1 : end;
+  }
+}
+
+// Appends src to dst at `at`, adding `base` to the listed relative indices.
+void merge_faces(const std::vector<int>& src, const std::vector<std::size_t>& relative, int base,
+                 std::vector<int>& dst, std::size_t at) {
+  std::copy(src.begin(), src.end(), dst.begin() + at);
+  for (std::size_t i : relative) dst[at + i] += base;
+}
+
+}  // namespace
+
+// The file is mapped and cut at line boundaries into chunks of about
+// CHUNK_BYTES, which are parsed in parallel and then concatenated in order.
+Mesh::Mesh(const std::string filename) {
+  constexpr std::size_t CHUNK_BYTES = 1 << 20;
+  MappedFile file(filename);
+  if (!file.bytes) return;
+  const char* text = reinterpret_cast<const char*>(file.bytes);
+  const char* end = text + file.size;
+
+  std::vector<const char*> cuts = {text};
+  while (end - cuts.back() > (std::ptrdiff_t)CHUNK_BYTES) {
+    const char* cut = cuts.back() + CHUNK_BYTES;
+    const char* newline = static_cast<const char*>(std::memchr(cut, '\n', end - cut));
+    if (!newline) break;
+    cuts.push_back(newline + 1);
+  }
+  cuts.push_back(end);
+  const int nchunks = cuts.size() - 1;
+  std::vector<ObjChunk> chunks(nchunks);
+  #pragma omp parallel for schedule(dynamic) if (nchunks > 1)
+  for (int c = 0; c < nchunks; c++) parse_obj_lines(cuts[c], cuts[c + 1], chunks[c]);
+
+  // Where each chunk's elements start in the merged arrays.
+  struct Offsets {
+    std::size_t vertices = 0, normals = 0, uvs = 0;
+    std::size_t face_vertices = 0, face_normals = 0, face_uvs = 0;
+  };
+  std::vector<Offsets> offsets(nchunks + 1);
+  for (int c = 0; c < nchunks; c++) {
+    const ObjChunk& chunk = chunks[c];
+    const Offsets& o = offsets[c];
+    offsets[c + 1] = {o.vertices + chunk.vertices.size(), o.normals + chunk.normals.size(),
+                      o.uvs + chunk.uvs.size(), o.face_vertices + chunk.face_vertices.size(),
+                      o.face_normals + chunk.face_normals.size(), o.face_uvs + chunk.face_uvs.size()};
+  }
+  const Offsets& total = offsets[nchunks];
+  vertices.resize(total.vertices);
+  normals.resize(total.normals);
+  uvs.resize(total.uvs);
+  face_vertices.resize(total.face_vertices);
+  face_normals.resize(total.face_normals);
+  face_uvs.resize(total.face_uvs);
+  #pragma omp parallel for if (nchunks > 1)
+  for (int c = 0; c < nchunks; c++) {
+    const ObjChunk& chunk = chunks[c];
+    const Offsets& o = offsets[c];
+    std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + o.vertices);
+    std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + o.normals);
+    std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs.begin() + o.uvs);
+    merge_faces(chunk.face_vertices, chunk.relative_vertices, o.vertices, face_vertices, o.face_vertices);
+    merge_faces(chunk.face_normals, chunk.relative_normals, o.normals, face_normals, o.face_normals);
+    merge_faces(chunk.face_uvs, chunk.relative_uvs, o.uvs, face_uvs, o.face_uvs);
+  }
+  compute_tangents();
+}
+
+namespace {
+
+// A corner of the tangent space: position, normal and uv indices, and
+// whether the face's uv mapping is mirrored.
+struct CornerKey {
+  int vertex, normal, uv;
+  bool mirrored;
+  bool operator==(const CornerKey&) const = default;
+};
+
+struct CornerKeyHash {
+  std::size_t operator()(const CornerKey& k) const {
+    std::uint64_t h = (std::uint64_t)(std::uint32_t)k.vertex * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (std::uint32_t)k.normal) * 0xC2B2AE3D27D4EB4Full;
+    h = (h ^ ((std::uint64_t)(std::uint32_t)k.uv << 1 | k.mirrored)) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+  }
+};
+
+// v without its component along the unit vector n.
+vec3 project(vec3 v, vec3 n) { return v - n * dot(n, v); }
+
+}  // namespace
+
+// Tangent frames as MikkTSpace builds them: at every corner the face's
+// tangent is projected onto the plane of the corner normal, normalized and
+// weighted by the corner angle in that plane. Corners are shared when they
+// have the same position, normal, uv and handedness, so mirrored uv islands
+// never blend. The bitangent is sign * cross(normal, tangent), the sign
+// being the handedness.
+void Mesh::compute_tangents() {
+  tangents.clear();
+  face_tangents.clear();
+  if (face_uvs.size() != face_vertices.size() ||
+      face_normals.size() != face_vertices.size())
+    return;
+
+  // Tangent and handedness of every face; a zero tangent for a degenerate
+  // uv mapping, which contributes nothing.
+  std::vector<vec3> face_tangent(nfaces());
+  std::vector<bool> mirrored(nfaces());
+  for (int f = 0; f < nfaces(); f++) {
+    vec3 e1 = vertex(f, 1) - vertex(f, 0), e2 = vertex(f, 2) - vertex(f, 0);
+    vec2 t0 = uv(f, 0), t1 = uv(f, 1), t2 = uv(f, 2);
+    double du1 = t1[0] - t0[0], dv1 = t1[1] - t0[1];
+    double du2 = t2[0] - t0[0], dv2 = t2[1] - t0[1];
+    double det = du1 * dv2 - du2 * dv1;
+    mirrored[f] = det < 0;
+    face_tangent[f] = std::abs(det) < 1e-20 ? vec3{0, 0, 0} : (e1 * dv2 - e2 * dv1) * (1 / det);
+  }
+
+  std::unordered_map<CornerKey, int, CornerKeyHash> corner_ids;
+  std::vector<vec3> tangent_sums;
+  std::vector<int> corner_normals;
+  std::vector<bool> corner_mirrored;
+  face_tangents.resize(face_vertices.size());
+  for (size_t c = 0; c < face_vertices.size(); c++) {
+    CornerKey key = {face_vertices[c], face_normals[c], face_uvs[c], mirrored[c / 3]};
+    auto [it, added] = corner_ids.try_emplace(key, (int)corner_normals.size());
+    if (added) {
+      tangent_sums.push_back(vec3{0, 0, 0});
+      corner_normals.push_back(face_normals[c]);
+      corner_mirrored.push_back(key.mirrored);
+    }
+    face_tangents[c] = it->second;
+  }
+
+  auto unit_normal = [&](int i) {
+    vec3 n = normals[i];
+    return n * (1 / std::max(norm(n), 1e-20));
+  };
+  for (int f = 0; f < nfaces(); f++) {
+    for (int k = 0; k < 3; k++) {
+      vec3 n = unit_normal(normal_index(f, k));
+      vec3 t = project(face_tangent[f], n);
+      double len = norm(t);
+      if (len < 1e-20) continue;
+      vec3 p = vertex(f, k);
+      vec3 a = project(vertex(f, (k + 1) % 3) - p, n), b = project(vertex(f, (k + 2) % 3) - p, n);
+      double ab = norm(a) * norm(b);
+      if (ab == 0) continue;
+      double angle = std::acos(std::clamp(dot(a, b) / ab, -1., 1.));
+      int id = face_tangents[f * 3 + k];
+      tangent_sums[id] = tangent_sums[id] + t * (angle / len);
+    }
+  }
+
+  tangents.resize(tangent_sums.size());
+  for (size_t i = 0; i < tangents.size(); i++) {
+    vec3 n = unit_normal(corner_normals[i]);
+    vec3 t = project(tangent_sums[i], n);
+    double len = norm(t);
+    if (len < 1e-20) {
+      // No usable uv gradient: any direction perpendicular to n will do
+      t = cross(n, std::abs(n[0]) < .9 ? vec3{1, 0, 0} : vec3{0, 1, 0});
+      len = norm(t);
+    }
+    t = t * (1 / len);
+    tangents[i] = vec4{t[0], t[1], t[2], corner_mirrored[i] ? -1. : 1.};
   }
 }
 
@@ -125,8 +345,199 @@ void Mesh::normalize() {
   }
 }
 
+namespace {
+
+// Binary mesh cache, native byte order: a MeshCacheHeader, then the arrays
+// in the order of `counts`, each padded to 8 bytes.
+struct MeshCacheHeader {
+  char magic[4];
+  std::uint32_t version;
+  // The source file the mesh was built from
+  std::uint64_t source_size;
+  std::int64_t source_mtime;  // file clock ticks
+  std::uint64_t source_hash;
+  // vertices, face_vertices, normals, face_normals, uvs, face_uvs,
+  // tangents, face_tangents
+  std::uint64_t counts[8];
+};
+
+constexpr char MESH_CACHE_MAGIC[4] = {'R', 'M', 'S', 'H'};
+constexpr std::uint32_t MESH_CACHE_VERSION = 2;
+
+// Hash of a file's bytes, 8 at a time, for sources whose mtime changed
+// without their contents.
+std::uint64_t hash_bytes(const std::uint8_t* p, std::size_t n) {
+  std::uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    std::uint64_t w;
+    std::memcpy(&w, p + i, 8);
+    h = (h ^ (w * 0xC2B2AE3D27D4EB4Full)) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+  }
+  for (; i < n; i++) h = (h ^ p[i]) * 0x100000001B3ull;
+  return h ^ (h >> 32);
+}
+
+bool source_stamp(const std::string& filename, std::uint64_t& size, std::int64_t& mtime) {
+  std::error_code ec;
+  size = std::filesystem::file_size(filename, ec);
+  if (ec) return false;
+  auto time = std::filesystem::last_write_time(filename, ec);
+  if (ec) return false;
+  mtime = time.time_since_epoch().count();
+  return true;
+}
+
+bool source_hash(const std::string& filename, std::uint64_t& hash) {
+  MappedFile file(filename);
+  if (!file.bytes) return false;
+  hash = hash_bytes(file.bytes, file.size);
+  return true;
+}
+
+constexpr std::size_t padded(std::size_t bytes) { return (bytes + 7) & ~std::size_t(7); }
+
+template <typename T>
+void write_array(std::ofstream& out, const std::vector<T>& array) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  const char zeros[8] = {};
+  std::size_t bytes = array.size() * sizeof(T);
+  out.write(reinterpret_cast<const char*>(array.data()), bytes);
+  out.write(zeros, padded(bytes) - bytes);
+}
+
+template <typename T>
+void read_array(const std::uint8_t*& p, std::size_t count, std::vector<T>& array) {
+  array.resize(count);
+  std::memcpy(array.data(), p, count * sizeof(T));
+  p += padded(count * sizeof(T));
+}
+
+// Records a new source mtime in an existing cache, so a touched source is
+// hashed once rather than on every load. Failing only costs that rehash.
+void update_cache_mtime(const std::string& filename, std::int64_t mtime) {
+  std::fstream out(filename, std::ios::in | std::ios::out | std::ios::binary);
+  if (!out.is_open()) return;
+  out.seekp(offsetof(MeshCacheHeader, source_mtime));
+  out.write(reinterpret_cast<const char*>(&mtime), sizeof(mtime));
+}
+
+// Indices of a face array are all below `count`, or it is empty.
+bool valid_indices(const std::vector<int>& face, std::size_t corners, std::size_t count) {
+  if (face.empty()) return true;
+  return face.size() == corners &&
+         std::all_of(face.begin(), face.end(), [&](int i) { return i >= 0 && (std::size_t)i < count; });
+}
+
+}  // namespace
+
+bool Mesh::write_cache(const std::string filename, const std::string source) const {
+  MeshCacheHeader header = {};
+  std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+  header.version = MESH_CACHE_VERSION;
+  if (!source_stamp(source, header.source_size, header.source_mtime) ||
+      !source_hash(source, header.source_hash))
+    return false;
+  const std::uint64_t counts[8] = {vertices.size(), face_vertices.size(), normals.size(),
+                                   face_normals.size(), uvs.size(), face_uvs.size(),
+                                   tangents.size(), face_tangents.size()};
+  std::memcpy(header.counts, counts, sizeof(counts));
+
+  // Written aside and renamed, so a reader never maps a partial cache.
+  const std::string partial = filename + ".part";
+  {
+    std::ofstream out(partial, std::ios::binary);
+    if (!out.is_open()) {
+      std::cerr << "can't open file " << partial << "\n";
+      return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_array(out, vertices);
+    write_array(out, face_vertices);
+    write_array(out, normals);
+    write_array(out, face_normals);
+    write_array(out, uvs);
+    write_array(out, face_uvs);
+    write_array(out, tangents);
+    write_array(out, face_tangents);
+    if (!out.good()) {
+      std::cerr << "can't write the mesh cache " << partial << "\n";
+      out.close();
+      std::remove(partial.c_str());
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(partial, filename, ec);
+  if (ec) {
+    std::cerr << "can't write the mesh cache " << filename << "\n";
+    std::remove(partial.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Mesh::read_cache(const std::string filename, const std::string source) {
+  MappedFile file(filename);
+  MeshCacheHeader header;
+  if (!file.bytes || file.size < sizeof(header)) return false;
+  std::memcpy(&header, file.bytes, sizeof(header));
+  if (std::memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != MESH_CACHE_VERSION)
+    return false;
+
+  // Stale unless the source has the same size and either the same mtime or,
+  // if it was only touched, the same contents.
+  std::uint64_t size, hash;
+  std::int64_t mtime;
+  if (!source_stamp(source, size, mtime) || size != header.source_size) return false;
+  if (mtime != header.source_mtime && (!source_hash(source, hash) || hash != header.source_hash))
+    return false;
+
+  const std::size_t sizes[8] = {sizeof(vec3), sizeof(int), sizeof(vec3), sizeof(int),
+                                sizeof(vec2), sizeof(int), sizeof(vec4), sizeof(int)};
+  std::size_t expected = sizeof(header);
+  for (int i = 0; i < 8; i++) {
+    if (header.counts[i] > file.size / sizes[i]) return false;
+    expected += padded(header.counts[i] * sizes[i]);
+  }
+  if (expected != file.size) return false;
+
+  Mesh mesh;
+  const std::uint8_t* p = file.bytes + sizeof(header);
+  read_array(p, header.counts[0], mesh.vertices);
+  read_array(p, header.counts[1], mesh.face_vertices);
+  read_array(p, header.counts[2], mesh.normals);
+  read_array(p, header.counts[3], mesh.face_normals);
+  read_array(p, header.counts[4], mesh.uvs);
+  read_array(p, header.counts[5], mesh.face_uvs);
+  read_array(p, header.counts[6], mesh.tangents);
+  read_array(p, header.counts[7], mesh.face_tangents);
+  const std::size_t corners = mesh.face_vertices.size();
+  if (corners % 3 != 0 || !valid_indices(mesh.face_vertices, corners, mesh.vertices.size()) ||
+      !valid_indices(mesh.face_normals, corners, mesh.normals.size()) ||
+      !valid_indices(mesh.face_uvs, corners, mesh.uvs.size()) ||
+      !valid_indices(mesh.face_tangents, corners, mesh.tangents.size())) {
+    std::cerr << "bad mesh cache " << filename << "\n";
+    return false;
+  }
+  vertices = std::move(mesh.vertices);
+  face_vertices = std::move(mesh.face_vertices);
+  normals = std::move(mesh.normals);
+  face_normals = std::move(mesh.face_normals);
+  uvs = std::move(mesh.uvs);
+  face_uvs = std::move(mesh.face_uvs);
+  tangents = std::move(mesh.tangents);
+  face_tangents = std::move(mesh.face_tangents);
+  if (mtime != header.source_mtime) update_cache_mtime(filename, mtime);
+  return true;
+}
+
 int Mesh::nverts() const { return vertices.size(); }
 
+int Mesh::nnormals() const { return normals.size(); }
+
 int Mesh::nfaces() const { return face_vertices.size() / 3; }
 
 vec3 Mesh::vertex(const int i) const { return vertices[i]; }
@@ -135,51 +546,114 @@ vec3 Mesh::vertex(const int iface, const int nthvertex) const {
   return vertices[face_vertices[iface * 3 + nthvertex]];
 }
 
+int Mesh::vertex_index(const int iface, const int nthvertex) const {
+  return face_vertices[iface * 3 + nthvertex];
+}
+
+vec3 Mesh::normal(const int i) const { return normals[i]; }
+
 vec3 Mesh::normal(const int iface, const int nthvertex) const {
   return normals[face_normals[iface * 3 + nthvertex]];
 }
 
+int Mesh::normal_index(const int iface, const int nthvertex) const {
+  return face_normals[iface * 3 + nthvertex];
+}
+
+int Mesh::ntangents() const { return tangents.size(); }
+
+vec4 Mesh::tangent(const int i) const { return tangents[i]; }
+
+int Mesh::tangent_index(const int iface, const int nthvertex) const {
+  return face_tangents[iface * 3 + nthvertex];
+}
+
 vec2 Mesh::uv(const int iface, const int nthvertex) const {
   if (face_uvs.empty()) return {0, 0};
   return uvs[face_uvs[iface * 3 + nthvertex]];
 }
 
-void Mesh::load_texture(const std::string filename) {
-    if (diffuse_map.read_tga_file(filename)) {
-        diffuse_map.flip_vertically();
-        has_texture = true;
+// Loads a map from a baked .tex file, which must already be in the plain or
+// compressed format, or builds it from a TGA image.
+static bool load_map(const std::string filename, TexelFormat plain, TexelFormat bc, bool compressed, Texture& map) {
+    if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".tex") == 0) {
+        Texture baked;
+        if (!baked.read_baked(filename)) return false;
+        if (baked.format() != plain && baked.format() != bc) {
+            std::cerr << filename << " is baked in the wrong format for this map\n";
+            return false;
+        }
+        map = baked;
+        return true;
     }
+    TGAImage image;
+    if (!image.read_tga_file(filename, true)) return false;
+    map = Texture(image, compressed ? bc : plain);
+    return true;
+}
+
+void Mesh::load_texture(const std::string filename, bool compressed) {
+    if (load_map(filename, TexelFormat::BGRA8, TexelFormat::BC1, compressed, diffuse_map))
+        has_texture = true;
 }
 
-void Mesh::load_normal_map(const std::string filename) {
-    if (normal_map.read_tga_file(filename)) {
-        normal_map.flip_vertically();
+void Mesh::load_normal_map(const std::string filename, bool compressed) {
+    if (load_map(filename, TexelFormat::NORMAL8, TexelFormat::BC5, compressed, normal_map))
         has_normal_map = true;
-    }
 }
 
-void Mesh::load_specular_map(const std::string filename) {
-    if (specular_map.read_tga_file(filename)) {
-        specular_map.flip_vertically();
+void Mesh::load_specular_map(const std::string filename, bool compressed) {
+    if (load_map(filename, TexelFormat::R8, TexelFormat::BC4, compressed, specular_map))
         has_specular_map = true;
-    }
 }
 
-TGAColor Mesh::diffuse(vec2 uv) const {
-    if (!has_texture) return {255, 255, 255, 255};
-    return diffuse_map.get(uv[0] * diffuse_map.width(), uv[1] * diffuse_map.height());
+std::uint32_t Mesh::diffuse(vec2 uv) const {
+    if (!has_texture) return 0xFFFFFFFF;
+    return diffuse_map.sample(uv);
 }
 
 float Mesh::specular(vec2 uv) const {
     if (!has_specular_map) return 1.0f;
-    return specular_map.get(uv[0] * specular_map.width(), uv[1] * specular_map.height())[0] / 1.0f;
+    return specular_map.sample(uv) / 1.0f;
+}
+
+// Tangent-space normal from channels in [-127, 127]. Two-channel maps
+// (BC5) only store x and y of a unit normal.
+static vec3 decode_normal(const float* n, int channels) {
+    vec3 res = vec3{n[0], n[1], channels > 2 ? n[2] : 0.f} / 127.;
+    if (channels == 2) res[2] = std::sqrt(std::max(0., 1. - res[0] * res[0] - res[1] * res[1]));
+    return res;
 }
 
 vec3 Mesh::normal(vec2 uv) const {
     if (!has_normal_map) return {0, 0, 0}; // Should handle this case in shader
-    TGAColor c = normal_map.get(uv[0] * normal_map.width(), uv[1] * normal_map.height());
-    vec3 res;
+    std::uint32_t t = normal_map.sample(uv);
+    float n[3];
     for (int i = 0; i < 3; i++)
-        res[2 - i] = (double)c[i] / 255. * 2. - 1.;
+        n[i] = (std::int8_t)(t >> 8 * i);
+    return decode_normal(n, normal_map.channels());
+}
+
+std::uint32_t Mesh::diffuse(vec2 uv, vec2 duvdx, vec2 duvdy) const {
+    if (!has_texture) return 0xFFFFFFFF;
+    float c[4];
+    diffuse_map.sample(uv, duvdx, duvdy, c);
+    std::uint32_t res = 0;
+    for (int i = 0; i < 4; i++)
+        res |= (std::uint32_t)std::clamp(c[i] + 0.5f, 0.f, 255.f) << 8 * i;
     return res;
 }
+
+float Mesh::specular(vec2 uv, vec2 duvdx, vec2 duvdy) const {
+    if (!has_specular_map) return 1.0f;
+    float s;
+    specular_map.sample(uv, duvdx, duvdy, &s);
+    return s;
+}
+
+vec3 Mesh::normal(vec2 uv, vec2 duvdx, vec2 duvdy) const {
+    if (!has_normal_map) return {0, 0, 0};
+    float n[3];
+    normal_map.sample(uv, duvdx, duvdy, n);
+    return decode_normal(n, normal_map.channels());
+}
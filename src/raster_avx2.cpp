@@ -0,0 +1,45 @@
+#include <immintrin.h>
+
+#include "raster_kernel.h"
+
+// Built with -mavx2; only called when the CPU reports support.
+template <bool test_edges>
+static std::uint64_t span_avx2(const RasterSpan& span, float* depth) {
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i e[3], step[3];
+  for (int k = 0; k < 3; k++) {
+    __m256i s = _mm256_set1_epi32(span.step[k]);
+    e[k] = _mm256_add_epi32(_mm256_set1_epi32(span.e[k]),
+                            _mm256_mullo_epi32(lane, s));
+    step[k] = _mm256_slli_epi32(s, 3);
+  }
+  const __m256 z = _mm256_set1_ps(span.z);
+  const __m256 dzdx = _mm256_set1_ps(span.dzdx);
+  const __m256 eight = _mm256_set1_ps(8.f);
+  __m256 idx = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(span.x0), lane));
+
+  std::uint64_t mask = 0;
+  for (int i = 0; i < span.count; i += 8) {
+    __m256 d = _mm256_add_ps(z, _mm256_mul_ps(dzdx, idx));
+    _mm256_storeu_ps(depth + i, d);
+    __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(span.count - i), lane);
+    __m256 zb = _mm256_maskload_ps(span.zbuffer + i, valid);
+    int pass = _mm256_movemask_ps(_mm256_cmp_ps(d, zb, _CMP_GT_OQ));
+    if (test_edges) {
+      __m256i inside = _mm256_or_si256(_mm256_or_si256(e[0], e[1]), e[2]);
+      pass &= ~_mm256_movemask_ps(_mm256_castsi256_ps(inside));
+      for (int k = 0; k < 3; k++) e[k] = _mm256_add_epi32(e[k], step[k]);
+    }
+    mask |= (std::uint64_t)(pass & 0xFF) << i;
+    idx = _mm256_add_ps(idx, eight);
+  }
+  return span.count < 64 ? mask & ((1ull << span.count) - 1) : mask;
+}
+
+std::uint64_t raster_span_avx2(const RasterSpan& span, float* depth) {
+  return span_avx2<true>(span, depth);
+}
+
+std::uint64_t raster_depth_avx2(const RasterSpan& span, float* depth) {
+  return span_avx2<false>(span, depth);
+}
@@ -0,0 +1,46 @@
+#include <immintrin.h>
+
+#include "raster_kernel.h"
+
+// Built with -mavx512f; only called when the CPU reports support.
+template <bool test_edges>
+static std::uint64_t span_avx512(const RasterSpan& span, float* depth) {
+  const __m512i lane =
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m512i e[3], step[3];
+  for (int k = 0; k < 3; k++) {
+    __m512i s = _mm512_set1_epi32(span.step[k]);
+    e[k] = _mm512_add_epi32(_mm512_set1_epi32(span.e[k]),
+                            _mm512_mullo_epi32(lane, s));
+    step[k] = _mm512_slli_epi32(s, 4);
+  }
+  const __m512 z = _mm512_set1_ps(span.z);
+  const __m512 dzdx = _mm512_set1_ps(span.dzdx);
+  const __m512 sixteen = _mm512_set1_ps(16.f);
+  __m512 idx = _mm512_cvtepi32_ps(_mm512_add_epi32(_mm512_set1_epi32(span.x0), lane));
+
+  std::uint64_t mask = 0;
+  for (int i = 0; i < span.count; i += 16) {
+    __m512 d = _mm512_add_ps(z, _mm512_mul_ps(dzdx, idx));
+    _mm512_storeu_ps(depth + i, d);
+    __mmask16 pass = _mm512_cmpgt_epi32_mask(_mm512_set1_epi32(span.count - i), lane);
+    if (test_edges) {
+      __m512i inside = _mm512_or_si512(_mm512_or_si512(e[0], e[1]), e[2]);
+      pass &= _mm512_cmpge_epi32_mask(inside, _mm512_setzero_si512());
+      for (int k = 0; k < 3; k++) e[k] = _mm512_add_epi32(e[k], step[k]);
+    }
+    __m512 zb = _mm512_maskz_loadu_ps(pass, span.zbuffer + i);
+    pass = _mm512_mask_cmp_ps_mask(pass, d, zb, _CMP_GT_OQ);
+    mask |= (std::uint64_t)pass << i;
+    idx = _mm512_add_ps(idx, sixteen);
+  }
+  return mask;
+}
+
+std::uint64_t raster_span_avx512(const RasterSpan& span, float* depth) {
+  return span_avx512<true>(span, depth);
+}
+
+std::uint64_t raster_depth_avx512(const RasterSpan& span, float* depth) {
+  return span_avx512<false>(span, depth);
+}
@@ -0,0 +1,50 @@
+#include <immintrin.h>
+
+#include "raster_kernel.h"
+
+// Built with -msse4.1; only called when the CPU reports support.
+template <bool test_edges>
+static std::uint64_t span_sse41(const RasterSpan& span, float* depth) {
+  const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+  __m128i e[3], step[3];
+  for (int k = 0; k < 3; k++) {
+    __m128i s = _mm_set1_epi32(span.step[k]);
+    e[k] = _mm_add_epi32(_mm_set1_epi32(span.e[k]), _mm_mullo_epi32(lane, s));
+    step[k] = _mm_slli_epi32(s, 2);
+  }
+  const __m128 z = _mm_set1_ps(span.z);
+  const __m128 dzdx = _mm_set1_ps(span.dzdx);
+  const __m128 four = _mm_set1_ps(4.f);
+  __m128 idx = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(span.x0), lane));
+
+  std::uint64_t mask = 0;
+  for (int i = 0; i < span.count; i += 4) {
+    __m128 d = _mm_add_ps(z, _mm_mul_ps(dzdx, idx));
+    _mm_storeu_ps(depth + i, d);
+    __m128 zb;
+    if (i + 4 <= span.count) {
+      zb = _mm_loadu_ps(span.zbuffer + i);
+    } else {
+      float tail[4] = {0, 0, 0, 0};
+      for (int j = 0; i + j < span.count; j++) tail[j] = span.zbuffer[i + j];
+      zb = _mm_loadu_ps(tail);
+    }
+    int pass = _mm_movemask_ps(_mm_cmpgt_ps(d, zb));
+    if (test_edges) {
+      __m128i inside = _mm_or_si128(_mm_or_si128(e[0], e[1]), e[2]);
+      pass &= ~_mm_movemask_ps(_mm_castsi128_ps(inside));
+      for (int k = 0; k < 3; k++) e[k] = _mm_add_epi32(e[k], step[k]);
+    }
+    mask |= (std::uint64_t)(pass & 0xF) << i;
+    idx = _mm_add_ps(idx, four);
+  }
+  return span.count < 64 ? mask & ((1ull << span.count) - 1) : mask;
+}
+
+std::uint64_t raster_span_sse41(const RasterSpan& span, float* depth) {
+  return span_sse41<true>(span, depth);
+}
+
+std::uint64_t raster_depth_sse41(const RasterSpan& span, float* depth) {
+  return span_sse41<false>(span, depth);
+}
@@ -1,12 +1,14 @@
 #include "renderer.h"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
 #include "imgui.h"
 #include "imgui_impl_sdl2.h"
 #include "imgui_impl_sdlrenderer2.h"
 
 extern mat4 ModelView, Perspective, Viewport;
-extern std::vector<float> zbuffer;
 
 Mesh create_sphere_model(float radius, int rings, int sectors) {
     std::vector<vec3> vertices;
@@ -65,20 +67,37 @@ Mesh create_sphere_model(float radius, int rings, int sectors) {
     return Mesh(vertices, faces, normals, face_normals, uvs, face_uvs);
 }
 
+// Material features a PhongShader variant is compiled for.
+enum PhongFeature : unsigned {
+    PHONG_TEXTURE = 1,     // diffuse texture
+    PHONG_NORMAL_MAP = 2,  // tangent-space normal map
+    PHONG_POINT_LIGHT = 4, // point light instead of a directional one
+    PHONG_VARIANTS = 8
+};
+
+// Serves one draw. transform_vertices() is the vertex stage: it runs once
+// per draw and fills the post-transform buffer that assemble() indexes.
+// The fragment stage lives in PhongVariant, compiled per feature set.
 struct PhongShader : IShader {
     const Mesh &mesh;
+    mat4 model_view;
+    mat4 normal_matrix; // inverse transpose of model_view
     vec3 l; // light position in View Space
-    vec3 tri[3];
-    vec3 nrmls[3];
-    vec2 uv[3];
-    mat<3,3> varying_tri;
-    bool is_point;
     TGAColor color;
     float intensity;
 
-  PhongShader(const vec3 light, float intens, const Mesh& m, const mat4& View, bool point_light = false, TGAColor c = {255, 255, 255, 255}) 
-      : mesh(m), is_point(point_light), color(c), intensity(intens) {
-    if (is_point) {
+    // Post-transform buffer, indexed like the mesh's vertices and normals
+    std::vector<vec4> clip_pos;
+    std::vector<vec3> view_pos;
+    std::vector<vec3> view_normals;
+    std::vector<vec4> view_tangents; // normal-mapped draws only
+
+  PhongShader(unsigned features, const vec3 light, float intens, const Mesh& m, const mat4& View, const mat4& MV, TGAColor c = {255, 255, 255, 255})
+      : mesh(m), model_view(MV), normal_matrix(MV.invert_transpose()), color(c), intensity(intens) {
+    // normal, position in View Space, then uv if anything samples textures,
+    // then the tangent frame for normal maps
+    nvaryings = (features & PHONG_NORMAL_MAP) ? 12 : (features & PHONG_TEXTURE) ? 8 : 6;
+    if (features & PHONG_POINT_LIGHT) {
         vec4 light_transformed = View * vec4{light.x(), light.y(), light.z(), 1.};
         l = light_transformed.xyz();
     } else {
@@ -87,44 +106,86 @@ struct PhongShader : IShader {
     }
   }
 
-    virtual vec4 vertex(const int face, const int vert) {
-        vec3 v = mesh.vertex(face, vert);
-        vec3 n = mesh.normal(face, vert);
-        uv[vert] = mesh.uv(face, vert);
-        nrmls[vert] = (ModelView.invert_transpose() * vec4{n.x(), n.y(), n.z(), 0.}).xyz();
-        vec4 gl_Position = ModelView * vec4{v.x(), v.y(), v.z(), 1.};
-        tri[vert] = gl_Position.xyz();
-        varying_tri.rows[vert] = tri[vert];
-        return Perspective * gl_Position;
+    void transform_vertices() {
+        clip_pos.resize(mesh.nverts());
+        view_pos.resize(mesh.nverts());
+        view_normals.resize(mesh.nnormals());
+        #pragma omp parallel for
+        for (int i = 0; i < mesh.nverts(); i++) {
+            vec3 v = mesh.vertex(i);
+            vec4 gl_Position = model_view * vec4{v.x(), v.y(), v.z(), 1.};
+            view_pos[i] = gl_Position.xyz();
+            clip_pos[i] = Perspective * gl_Position;
+        }
+        #pragma omp parallel for
+        for (int i = 0; i < mesh.nnormals(); i++) {
+            vec3 n = mesh.normal(i);
+            view_normals[i] = (normal_matrix * vec4{n.x(), n.y(), n.z(), 0.}).xyz();
+        }
+        view_tangents.resize(nvaryings > 8 ? mesh.ntangents() : 0);
+        #pragma omp parallel for
+        for (int i = 0; i < (int)view_tangents.size(); i++) {
+            vec4 t = mesh.tangent(i);
+            vec3 tv = (model_view * vec4{t.x(), t.y(), t.z(), 0.}).xyz();
+            view_tangents[i] = vec4{tv.x(), tv.y(), tv.z(), t.w()};
+        }
+    }
+
+    // Triangle assembly: gathers face's corners from the post-transform buffer.
+    void assemble(const int face, Triangle& clip, Varyings varying[3]) const {
+        for (int vert = 0; vert < 3; vert++) {
+            int v = mesh.vertex_index(face, vert);
+            vec3 n = view_normals[mesh.normal_index(face, vert)];
+            clip[vert] = clip_pos[v];
+            for (int i = 0; i < 3; i++) {
+                varying[vert][i] = n[i];
+                varying[vert][3 + i] = view_pos[v][i];
+            }
+            if (nvaryings > 6) {
+                vec2 uv = mesh.uv(face, vert);
+                varying[vert][6] = uv[0];
+                varying[vert][7] = uv[1];
+            }
+            if (nvaryings > 8) {
+                vec4 t = view_tangents[mesh.tangent_index(face, vert)];
+                for (int i = 0; i < 4; i++) varying[vert][8 + i] = t[i];
+            }
+        }
+    }
+};
+
+template <unsigned Features>
+struct PhongVariant final : PhongShader {
+    using PhongShader::PhongShader;
+
+    QuadShader quad_shader(bool batched) const override {
+        return batched ? shade_quads<PhongVariant> : shade_pixels<PhongVariant>;
     }
 
-    virtual std::pair<bool,TGAColor> fragment(const vec3 bar) const {
+    std::pair<bool,TGAColor> fragment(const float* varying, int) const override {
         TGAColor gl_FragColor = color;
-        vec2 uv_interp = uv[0]*bar[0] + uv[1]*bar[1] + uv[2]*bar[2];
-        TGAColor tex_color = mesh.diffuse(uv_interp);
-        for (int i=0; i<3; i++) gl_FragColor[i] = (gl_FragColor[i] * tex_color[i]) / 255;
+        vec2 uv_interp;
+        if constexpr ((Features & (PHONG_TEXTURE | PHONG_NORMAL_MAP)) != 0)
+            uv_interp = {varying[6], varying[7]};
+        if constexpr ((Features & PHONG_TEXTURE) != 0) {
+            std::uint32_t tex_color = mesh.diffuse(uv_interp);
+            for (int i=0; i<3; i++) gl_FragColor[i] = (gl_FragColor[i] * (tex_color >> 8*i & 255)) / 255;
+        }
         
-        vec3 n = normalize(nrmls[0]*bar[0] + nrmls[1]*bar[1] + nrmls[2]*bar[2]); // normal vector (smooth shading)
+        vec3 n = normalize(vec3{varying[0], varying[1], varying[2]}); // normal vector (smooth shading)
         
-        if (mesh.hasNormalMap()) {
-            mat<3,3> A;
-            A[0] = varying_tri.rows[1] - varying_tri.rows[0];
-            A[1] = varying_tri.rows[2] - varying_tri.rows[0];
-            A[2] = n;
-            mat<3,3> AI = A.invert();
-            vec3 i = AI * vec3(uv[1][0] - uv[0][0], uv[2][0] - uv[0][0], 0);
-            vec3 j = AI * vec3(uv[1][1] - uv[0][1], uv[2][1] - uv[0][1], 0);
-            mat<3,3> B;
-            B[0] = i.xyz();
-            B[1] = j.xyz();
-            B[2] = n;
+        if constexpr ((Features & PHONG_NORMAL_MAP) != 0) {
+            // Per-vertex tangent frame, re-orthogonalized against n
+            vec3 t = {varying[8], varying[9], varying[10]};
+            t = normalize(t - n * dot(n, t));
+            vec3 b = cross(n, t) * (varying[11] < 0 ? -1. : 1.);
             vec3 texture_n = mesh.normal(uv_interp);
-            n = normalize(B.transpose() * texture_n);
+            n = normalize(t * texture_n[0] + b * texture_n[1] + n * texture_n[2]);
         }
 
         vec3 light_dir_vec;
-        if (is_point) {
-            vec3 p = tri[0]*bar[0] + tri[1]*bar[1] + tri[2]*bar[2]; // fragment position in View Space
+        if constexpr ((Features & PHONG_POINT_LIGHT) != 0) {
+            vec3 p = {varying[3], varying[4], varying[5]}; // fragment position in View Space
             light_dir_vec = normalize(l - p);
         } else {
             light_dir_vec = l;
@@ -134,14 +195,100 @@ struct PhongShader : IShader {
         double ambient = .3;
         double diff = std::max(0., dot(n, light_dir_vec));
         
-        double specular_val = mesh.hasSpecularMap() ? mesh.specular(uv_interp) : 255.0;
         double spec = std::pow(std::max(r.z(), 0.), 35);
         for (int channel : {0,1,2})
             gl_FragColor[channel] *= std::min(1., (ambient + .4*diff + .9*spec) * intensity);
         return {false, gl_FragColor};
     }
+
+    // fragment() over a quad, one lane per array column so the vector math
+    // of the four lanes runs side by side. Texture fetches and the specular
+    // power are scalar and skip the helper lanes. Textures are mipmapped
+    // with the quad's uv derivatives, otherwise every covered lane rounds
+    // exactly like fragment().
+    unsigned fragment_quad(const FragmentQuad& quad, int, TGAColor colors[4]) const override {
+        const auto& v = quad.varyings;
+        vec2 duvdx, duvdy;
+        if constexpr ((Features & (PHONG_TEXTURE | PHONG_NORMAL_MAP)) != 0) {
+            duvdx = {quad.ddx(6), quad.ddx(7)};
+            duvdy = {quad.ddy(6), quad.ddy(7)};
+        }
+        double n[3][4], ld[3][4], r[3][4], nl[4];
+        for (int i = 0; i < 3; i++)
+            for (int lane = 0; lane < 4; lane++) n[i][lane] = v[i][lane];
+        normalize_lanes(n);
+
+        if constexpr ((Features & PHONG_NORMAL_MAP) != 0) {
+            double t[3][4], tn[3][4];
+            for (int lane = 0; lane < 4; lane++) {
+                vec3 texture_n = (quad.mask >> lane & 1) ? mesh.normal(vec2{v[6][lane], v[7][lane]}, duvdx, duvdy) : vec3{};
+                for (int i = 0; i < 3; i++) tn[i][lane] = texture_n[i];
+            }
+            for (int lane = 0; lane < 4; lane++) {
+                double nt = n[0][lane] * v[8][lane] + n[1][lane] * v[9][lane] + n[2][lane] * v[10][lane];
+                for (int i = 0; i < 3; i++) t[i][lane] = v[8 + i][lane] - n[i][lane] * nt;
+            }
+            normalize_lanes(t);
+            for (int lane = 0; lane < 4; lane++) {
+                double sign = v[11][lane] < 0 ? -1. : 1.;
+                double b[3];
+                for (int i = 0; i < 3; i++) {
+                    int j = (i + 1) % 3, k = (i + 2) % 3;
+                    b[i] = (n[j][lane] * t[k][lane] - n[k][lane] * t[j][lane]) * sign;
+                }
+                for (int i = 0; i < 3; i++)
+                    n[i][lane] = t[i][lane] * tn[0][lane] + b[i] * tn[1][lane] + n[i][lane] * tn[2][lane];
+            }
+            normalize_lanes(n);
+        }
+
+        for (int i = 0; i < 3; i++)
+            for (int lane = 0; lane < 4; lane++)
+                ld[i][lane] = (Features & PHONG_POINT_LIGHT) != 0 ? l[i] - v[3 + i][lane] : l[i];
+        if constexpr ((Features & PHONG_POINT_LIGHT) != 0) normalize_lanes(ld);
+
+        for (int lane = 0; lane < 4; lane++)
+            nl[lane] = n[0][lane] * ld[0][lane] + n[1][lane] * ld[1][lane] + n[2][lane] * ld[2][lane];
+        for (int i = 0; i < 3; i++)
+            for (int lane = 0; lane < 4; lane++) r[i][lane] = n[i][lane] * (nl[lane] * 2.0) - ld[i][lane];
+        normalize_lanes(r);
+
+        for (unsigned m = quad.mask; m; m &= m - 1) {
+            int lane = std::countr_zero(m);
+            TGAColor gl_FragColor = color;
+            if constexpr ((Features & PHONG_TEXTURE) != 0) {
+                std::uint32_t tex_color = mesh.diffuse(vec2{v[6][lane], v[7][lane]}, duvdx, duvdy);
+                for (int i=0; i<3; i++) gl_FragColor[i] = (gl_FragColor[i] * (tex_color >> 8*i & 255)) / 255;
+            }
+            double diff = std::max(0., nl[lane]);
+            double spec = std::pow(std::max(r[2][lane], 0.), 35);
+            for (int channel : {0,1,2})
+                gl_FragColor[channel] *= std::min(1., (.3 + .4*diff + .9*spec) * intensity);
+            colors[lane] = gl_FragColor;
+        }
+        return quad.mask;
+    }
+
+private:
+    // vec3::normalized() on each lane of v[axis][lane].
+    static void normalize_lanes(double (&v)[3][4]) {
+        for (int lane = 0; lane < 4; lane++) {
+            double length = std::sqrt(v[0][lane] * v[0][lane] + v[1][lane] * v[1][lane] + v[2][lane] * v[2][lane]);
+            for (int i = 0; i < 3; i++) v[i][lane] = length > 0 ? v[i][lane] / length : 0.;
+        }
+    }
 };
 
+// Instantiates the PhongVariant compiled for `features`.
+template <unsigned Features = 0>
+static std::unique_ptr<PhongShader> make_phong_shader(unsigned features, const vec3 light, float intens, const Mesh& m, const mat4& View, const mat4& MV, TGAColor c) {
+    if constexpr (Features + 1 < PHONG_VARIANTS) {
+        if (features != Features)
+            return make_phong_shader<Features + 1>(features, light, intens, m, View, MV, c);
+    }
+    return std::make_unique<PhongVariant<Features>>(Features, light, intens, m, View, MV, c);
+}
+
 // --- Renderer Implementation ---
 
 Renderer::Renderer(int w, int h) 
@@ -159,6 +306,17 @@ Renderer::~Renderer() {
     SDL_Quit();
 }
 
+void Renderer::record_frames(const std::string& directory, std::size_t queue) {
+    stop_recording();
+    frame_writer = std::make_unique<FrameWriter>(queue);
+    frame_directory = directory;
+    frame_index = 0;
+}
+
+void Renderer::stop_recording() {
+    frame_writer.reset();
+}
+
 bool Renderer::init() {
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cerr << "Could not init SDL: " << SDL_GetError() << std::endl;
@@ -178,8 +336,8 @@ bool Renderer::init() {
     // Init graphics pipeline
     lookat(eye, center, up);
     init_perspective(norm(eye - center));
-    init_viewport(width / 16, height / 16, width * 7 / 8, height * 7 / 8);
-    init_zbuffer(width, height);
+    if (!init_viewport(width / 16, height / 16, width * 7 / 8, height * 7 / 8)) return false;
+    if (!init_zbuffer(width, height, depth_format)) return false;
     
     last_time = SDL_GetTicks();
     
@@ -227,10 +385,20 @@ RenderObject* Renderer::create_sphere(float radius, TGAColor color, int rings, i
     return obj;
 }
 
+Mesh Renderer::read_mesh(const std::string& filename) {
+    // The normalized mesh is cached next to the OBJ file, e.g. head.obj.rmesh
+    const std::string cache = filename + ".rmesh";
+    Mesh m;
+    if (!m.read_cache(cache, filename)) {
+        m = Mesh(filename);
+        m.normalize();
+        if (m.nfaces() > 0) m.write_cache(cache, filename);
+    }
+    return m;
+}
+
 RenderObject* Renderer::load_mesh(const std::string& filename, TGAColor color) {
-    Mesh m(filename);
-    m.normalize();
-    RenderObject* obj = new RenderObject(m, {0,0,0}, color);
+    RenderObject* obj = new RenderObject(read_mesh(filename), {0,0,0}, color);
     objects.push_back(obj);
     return obj;
 }
@@ -259,34 +427,82 @@ void Renderer::render() {
     
     ImGui::Render();
     
-    // Clear buffers
-    framebuffer.clear();
-    init_zbuffer(width, height);
+    // Clear buffers; tiles are reset lazily by the back-end
+    if (depth_format != ::depth_format()) init_zbuffer(width, height, depth_format);
+    clear_buffers();
     
     // Update view matrix
     lookat(eye, center, up);
     mat4 View = ModelView;
     
-    // Render loop
-    for (auto* obj : objects) {
+    // Draw objects front to back so the hierarchical z-buffer can reject
+    // whatever they hide.
+    std::vector<RenderObject*> draw_order(objects);
+    std::stable_sort(draw_order.begin(), draw_order.end(), [&](RenderObject* a, RenderObject* b) {
+        return norm(a->position - eye) < norm(b->position - eye);
+    });
+
+    // Front-end: one shader per draw with its uniforms computed once, then
+    // every unique vertex transformed once into the post-transform buffers.
+    std::vector<std::unique_ptr<PhongShader>> shaders;
+    std::vector<size_t> first_face; // index of each object's first face
+    size_t total_faces = 0;
+    shaders.reserve(draw_order.size());
+
+    for (auto* obj : draw_order) {
         mat4 Translation = {{{1, 0, 0, obj->position[0]},
                              {0, 1, 0, obj->position[1]},
                              {0, 0, 1, obj->position[2]},
                              {0, 0, 0, 1}}};
-        
-        ModelView = View * Translation;
-        
-        #pragma omp parallel for
-        for (int i = 0; i < obj->mesh.nfaces(); i++) {
-            PhongShader shader(light_dir, light_intensity, obj->mesh, View, true, obj->color);
-            Triangle clip = {shader.vertex(i, 0),
-                             shader.vertex(i, 1),
-                             shader.vertex(i, 2)};
-            rasterize(clip, shader, framebuffer);
+        // The shader variant is picked once per draw from the material
+        unsigned features = PHONG_POINT_LIGHT;
+        if (obj->mesh.hasTexture()) features |= PHONG_TEXTURE;
+        if (obj->mesh.hasNormalMap() && obj->mesh.hasTangents()) features |= PHONG_NORMAL_MAP;
+        shaders.push_back(make_phong_shader(features, light_dir, light_intensity, obj->mesh, View, View * Translation, obj->color));
+        shaders.back()->transform_vertices();
+        first_face.push_back(total_faces);
+        total_faces += obj->mesh.nfaces();
+    }
+
+    // Clipping can turn a face into several triangles, so faces are set up
+    // in contiguous chunks that are concatenated in submission order.
+    const size_t chunk_size = 256;
+    const int n_chunks = (total_faces + chunk_size - 1) / chunk_size;
+    std::vector<std::vector<RasterTriangle>> chunks(n_chunks);
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < n_chunks; c++) {
+        size_t begin = c * chunk_size, end = std::min(total_faces, begin + chunk_size);
+        size_t o = std::upper_bound(first_face.begin(), first_face.end(), begin) - first_face.begin() - 1;
+        RasterTriangle pieces[MAX_CLIPPED_TRIANGLES];
+        for (size_t f = begin; f < end; f++) {
+            while (f >= first_face[o] + draw_order[o]->mesh.nfaces()) o++;
+            int i = f - first_face[o];
+            Triangle clip;
+            Varyings varyings[3];
+            const PhongShader& shader = *shaders[o];
+            shader.assemble(i, clip, varyings);
+            int n = inline_shaders
+                ? setup_raster_triangles(clip, varyings, static_cast<const IShader&>(shader), i, pieces)
+                : setup_raster_triangles<IShader>(clip, varyings, shader, i, pieces);
+            if (!batch_shading)
+                for (int k = 0; k < n; k++)
+                    pieces[k].shade = inline_shaders ? shader.quad_shader(false) : shade_pixels<IShader>;
+            chunks[c].insert(chunks[c].end(), pieces, pieces + n);
         }
     }
-    
-    ModelView = View; // Restore View matrix for next frame
+    std::vector<RasterTriangle> triangles;
+    for (auto& chunk : chunks) triangles.insert(triangles.end(), chunk.begin(), chunk.end());
+
+    // Back-end: every tile is rasterized by exactly one thread.
+    bin_triangles(triangles);
+    stats = rasterize_bins(triangles, framebuffer, shading_mode);
+
+    // Rows are stored top to bottom, as SDL expects
+    if (frame_writer) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/frame_%05d.tga", frame_index++);
+        frame_writer->push(framebuffer, frame_directory + name, false);
+    }
     
     // Push framebuffer to SDL
     SDL_UpdateTexture(texture, nullptr, framebuffer.buffer(), width * 3);
@@ -0,0 +1,428 @@
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#include "mapped_file.h"
+
+static int block_bytes_of(TexelFormat format) {
+  switch (format) {
+    case TexelFormat::R8: return 16;
+    case TexelFormat::BC1:
+    case TexelFormat::BC4: return 8;
+    case TexelFormat::BC5: return 16;
+    default: return 64;
+  }
+}
+
+// Uncompressed format a block-compressed one is encoded from.
+static TexelFormat source_format(TexelFormat format) {
+  switch (format) {
+    case TexelFormat::BC1: return TexelFormat::BGRA8;
+    case TexelFormat::BC4: return TexelFormat::R8;
+    case TexelFormat::BC5: return TexelFormat::NORMAL8;
+    default: return format;
+  }
+}
+
+// Converts a texel of a TGA image into the packed layout of `format`.
+static std::uint32_t convert(TGAColor c, TexelFormat format) {
+  switch (format) {
+    case TexelFormat::R8:
+      return c[0];
+    case TexelFormat::NORMAL8: {
+      // BGR bytes in [0, 255] map to z, y, x in [-1, 1].
+      std::uint32_t t = 0;
+      for (int i = 0; i < 3; i++) {
+        double v = (double)c[2 - i] / 255. * 2. - 1.;
+        t |= (std::uint32_t)(std::uint8_t)(std::int8_t)std::lround(v * 127) << 8 * i;
+      }
+      return t;
+    }
+    default:
+      break;
+  }
+  if (c.bytespp == TGAImage::GRAYSCALE) c[1] = c[2] = c[0];
+  if (c.bytespp != TGAImage::RGBA) c[3] = 255;
+  return c[0] | c[1] << 8 | c[2] << 16 | (std::uint32_t)c[3] << 24;
+}
+
+// --- BC1: two RGB565 endpoints and a 2-bit palette index per texel ---
+
+static std::uint32_t expand565(int c) {
+  int r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+  return (b << 3 | b >> 2) | (g << 2 | g >> 4) << 8 | (r << 3 | r >> 2) << 16 | 0xFF000000u;
+}
+
+// Entry `index` of a BC1 block's palette as packed BGRA. c0 <= c1 selects
+// the three-color mode, whose fourth entry is transparent black; the encoder
+// only emits it with c0 == c1 and every index 0.
+static std::uint32_t bc1_color(int c0, int c1, int index) {
+  if (index < 2) return expand565(index ? c1 : c0);
+  if (c0 <= c1 && index == 3) return 0;
+  std::uint32_t e0 = expand565(c0), e1 = expand565(c1), color = 0xFF000000u;
+  for (int i = 0; i < 3; i++) {
+    int a = e0 >> 8 * i & 255, b = e1 >> 8 * i & 255;
+    int mix = c0 <= c1 ? (a + b + 1) / 2 : index == 2 ? (2 * a + b + 1) / 3 : (a + 2 * b + 1) / 3;
+    color |= (std::uint32_t)mix << 8 * i;
+  }
+  return color;
+}
+
+static int color_distance(std::uint32_t a, std::uint32_t b) {
+  int d = 0;
+  for (int i = 0; i < 3; i++) {
+    int e = (int)(a >> 8 * i & 255) - (int)(b >> 8 * i & 255);
+    d += e * e;
+  }
+  return d;
+}
+
+// Endpoints are the extreme texels along the principal axis of the block's
+// colors, found by a few power iterations on their covariance.
+static void encode_bc1(const std::uint32_t texels[16], std::uint8_t* out) {
+  float mean[3] = {0, 0, 0};
+  for (int t = 0; t < 16; t++)
+    for (int i = 0; i < 3; i++) mean[i] += (texels[t] >> 8 * i & 255) / 16.f;
+  float cov[6] = {0, 0, 0, 0, 0, 0};  // xx xy xz yy yz zz
+  for (int t = 0; t < 16; t++) {
+    float d[3];
+    for (int i = 0; i < 3; i++) d[i] = (texels[t] >> 8 * i & 255) - mean[i];
+    cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+  }
+  float axis[3] = {1, 1, 1};
+  for (int iter = 0; iter < 4; iter++) {
+    float a[3] = {cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                  cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                  cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]};
+    float m = std::max({std::abs(a[0]), std::abs(a[1]), std::abs(a[2])});
+    if (m == 0) break;
+    for (int i = 0; i < 3; i++) axis[i] = a[i] / m;
+  }
+  int lo = 0, hi = 0;
+  float min_proj = 1e30f, max_proj = -1e30f;
+  for (int t = 0; t < 16; t++) {
+    float proj = 0;
+    for (int i = 0; i < 3; i++) proj += (texels[t] >> 8 * i & 255) * axis[i];
+    if (proj < min_proj) min_proj = proj, lo = t;
+    if (proj > max_proj) max_proj = proj, hi = t;
+  }
+
+  auto to565 = [](std::uint32_t c) {
+    int b = c & 255, g = c >> 8 & 255, r = c >> 16 & 255;
+    return (r * 31 + 127) / 255 << 11 | (g * 63 + 127) / 255 << 5 | (b * 31 + 127) / 255;
+  };
+  int c0 = to565(texels[hi]), c1 = to565(texels[lo]);
+  if (c0 < c1) std::swap(c0, c1);
+  std::uint32_t palette[4];
+  for (int k = 0; k < 4; k++) palette[k] = bc1_color(c0, c1, k);
+  std::uint32_t indices = 0;
+  if (c0 != c1)
+    for (int t = 0; t < 16; t++) {
+      int best = 0;
+      for (int k = 1; k < 4; k++)
+        if (color_distance(texels[t], palette[k]) < color_distance(texels[t], palette[best])) best = k;
+      indices |= (std::uint32_t)best << 2 * t;
+    }
+  out[0] = c0 & 255; out[1] = c0 >> 8;
+  out[2] = c1 & 255; out[3] = c1 >> 8;
+  std::memcpy(out + 4, &indices, 4);
+}
+
+// --- BC4: two 8-bit endpoints and a 3-bit palette index per texel ---
+
+// Eight-value palette of endpoints e0 >= e1, signed or not.
+static int bc4_value(int e0, int e1, int index) {
+  if (index < 2) return index ? e1 : e0;
+  return ((8 - index) * e0 + (index - 1) * e1) / 7;
+}
+
+static int decode_bc4(const std::uint8_t* block, bool snorm, int i) {
+  int e0 = snorm ? (std::int8_t)block[0] : block[0];
+  int e1 = snorm ? (std::int8_t)block[1] : block[1];
+  std::uint64_t bits = 0;
+  std::memcpy(&bits, block + 2, 6);
+  return bc4_value(e0, e1, bits >> 3 * i & 7);
+}
+
+static void encode_bc4(const int values[16], std::uint8_t* out) {
+  int e0 = *std::max_element(values, values + 16), e1 = *std::min_element(values, values + 16);
+  std::uint64_t bits = 0;
+  if (e0 != e1)
+    for (int t = 0; t < 16; t++) {
+      int best = 0;
+      for (int k = 1; k < 8; k++)
+        if (std::abs(values[t] - bc4_value(e0, e1, k)) < std::abs(values[t] - bc4_value(e0, e1, best)))
+          best = k;
+      bits |= (std::uint64_t)best << 3 * t;
+    }
+  out[0] = (std::uint8_t)e0;
+  out[1] = (std::uint8_t)e1;
+  std::memcpy(out + 2, &bits, 6);
+}
+
+std::uint32_t Texture::decode(const std::uint8_t* block, int i) const {
+  switch (texel_format) {
+    case TexelFormat::BC1: {
+      std::uint32_t indices;
+      std::memcpy(&indices, block + 4, 4);
+      return bc1_color(block[0] | block[1] << 8, block[2] | block[3] << 8, indices >> 2 * i & 3);
+    }
+    case TexelFormat::BC4:
+      return decode_bc4(block, false, i);
+    case TexelFormat::BC5:
+      return (std::uint8_t)decode_bc4(block, true, i) |
+             (std::uint32_t)(std::uint8_t)decode_bc4(block + 8, true, i) << 8;
+    default:
+      return 0;
+  }
+}
+
+int Texture::channels() const {
+  switch (texel_format) {
+    case TexelFormat::R8:
+    case TexelFormat::BC4: return 1;
+    case TexelFormat::BC5: return 2;
+    case TexelFormat::NORMAL8: return 3;
+    default: return 4;
+  }
+}
+
+// Lays out the mip chain of a w x h level 0. Returns its size in bytes.
+std::size_t Texture::layout(int w, int h) {
+  pow2 = (w & (w - 1)) == 0 && (h & (h - 1)) == 0;
+  levels.clear();
+  std::size_t size = 0;
+  for (;;) {
+    int blocks_w = (w + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int blocks_h = (h + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    levels.push_back({w, h, blocks_w, size});
+    size += (std::size_t)blocks_w * blocks_h * block_bytes;
+    if (w == 1 && h == 1) break;
+    w = std::max(1, w / 2);
+    h = std::max(1, h / 2);
+  }
+  return size;
+}
+
+// Lays out the mip chain and allocates its blocks on the heap. The buffer is
+// only written while the texture is being built.
+std::uint8_t* Texture::allocate(int w, int h) {
+  data_size = layout(w, h);
+  std::uint8_t* buffer = new std::uint8_t[data_size]();
+  storage.reset(buffer, std::default_delete<std::uint8_t[]>());
+  data = buffer;
+  return buffer;
+}
+
+Texture::Texture(const TGAImage& image, TexelFormat format)
+    : texel_format(format), block_bytes(block_bytes_of(format)) {
+  if (image.width() <= 0 || image.height() <= 0) return;
+  if (compressed()) {
+    Texture source(image, source_format(format));
+    encode(source, allocate(source.width(), source.height()));
+    return;
+  }
+  std::uint8_t* buffer = allocate(image.width(), image.height());
+  for (int y = 0; y < height(); y++)
+    for (int x = 0; x < width(); x++) store(buffer, 0, x, y, convert(image.get(x, y), format));
+  for (int level = 1; level < nlevels(); level++) {
+    const Level& src = levels[level - 1];
+    for (int y = 0; y < levels[level].height; y++)
+      for (int x = 0; x < levels[level].width; x++) {
+        // Odd sides drop their last texel; a side of 1 is kept as is.
+        int x1 = std::min(2 * x + 1, src.width - 1), y1 = std::min(2 * y + 1, src.height - 1);
+        std::uint32_t c[4] = {texel(level - 1, 2 * x, 2 * y), texel(level - 1, x1, 2 * y),
+                              texel(level - 1, 2 * x, y1), texel(level - 1, x1, y1)};
+        std::uint32_t avg = 0;
+        for (int i = 0; i < channels(); i++) {
+          int sum = channel(c[0], i) + channel(c[1], i) + channel(c[2], i) + channel(c[3], i);
+          avg |= (std::uint32_t)(std::uint8_t)((sum + 2) >> 2) << 8 * i;
+        }
+        store(buffer, level, x, y, avg);
+      }
+  }
+}
+
+// Compresses every block of every level of `source`, whose format is this
+// texture's source_format(), into the laid out buffer. Partial blocks repeat
+// their last row and column.
+void Texture::encode(const Texture& source, std::uint8_t* buffer) {
+  for (int level = 0; level < nlevels(); level++) {
+    const Level& l = levels[level];
+    for (int by = 0; by * BLOCK_SIZE < l.height; by++)
+      for (int bx = 0; bx < l.blocks_w; bx++) {
+        std::uint32_t texels[16];
+        for (int i = 0; i < 16; i++)
+          texels[i] = source.texel(level, std::min(bx * BLOCK_SIZE + i % BLOCK_SIZE, l.width - 1),
+                                   std::min(by * BLOCK_SIZE + i / BLOCK_SIZE, l.height - 1));
+        std::uint8_t* out = buffer + l.offset + ((std::size_t)by * l.blocks_w + bx) * block_bytes;
+        if (texel_format == TexelFormat::BC1) {
+          encode_bc1(texels, out);
+          continue;
+        }
+        // BC4 is channel 0; BC5 is signed x and y, one BC4 block each.
+        for (int c = 0; c < (texel_format == TexelFormat::BC5 ? 2 : 1); c++) {
+          int values[16];
+          for (int i = 0; i < 16; i++) values[i] = source.channel(texels[i], c);
+          encode_bc4(values, out + 8 * c);
+        }
+      }
+  }
+}
+
+void Texture::store(std::uint8_t* buffer, int level, int x, int y, std::uint32_t texel) {
+  const Level& l = levels[level];
+  std::size_t block = (std::size_t)(y >> BLOCK_BITS) * l.blocks_w + (x >> BLOCK_BITS);
+  int i = ((y & (BLOCK_SIZE - 1)) << BLOCK_BITS) + (x & (BLOCK_SIZE - 1));
+  int size = block_bytes / (BLOCK_SIZE * BLOCK_SIZE);
+  std::memcpy(buffer + l.offset + block * block_bytes + i * size, &texel, size);
+}
+
+float Texture::lod(vec2 duvdx, vec2 duvdy) const {
+  double w = width(), h = height();
+  double dx = (duvdx[0] * w) * (duvdx[0] * w) + (duvdx[1] * h) * (duvdx[1] * h);
+  double dy = (duvdy[0] * w) * (duvdy[0] * w) + (duvdy[1] * h) * (duvdy[1] * h);
+  return 0.5f * (float)std::log2(std::max(dx, dy));
+}
+
+std::uint32_t Texture::sample(vec2 uv) const {
+  if (levels.empty()) return 0;
+  int x = (int)std::floor(uv[0] * width());
+  int y = (int)std::floor(uv[1] * height());
+  return texel(0, wrap(x, width()), wrap(y, height()));
+}
+
+// Adds weight times the bilinear sample of level at uv to sum[0..channels).
+void Texture::bilinear(int level, vec2 uv, float weight, float* sum) const {
+  const Level& l = levels[level];
+  double u = uv[0] * l.width - 0.5, v = uv[1] * l.height - 0.5;
+  double fu = std::floor(u), fv = std::floor(v);
+  float s = (float)(u - fu), t = (float)(v - fv);
+  int x0 = wrap((int)fu, l.width), y0 = wrap((int)fv, l.height);
+  int x1 = x0 + 1 == l.width ? 0 : x0 + 1, y1 = y0 + 1 == l.height ? 0 : y0 + 1;
+  std::uint32_t c00 = texel(level, x0, y0), c10 = texel(level, x1, y0);
+  std::uint32_t c01 = texel(level, x0, y1), c11 = texel(level, x1, y1);
+  for (int i = 0; i < channels(); i++) {
+    float top = channel(c00, i) + (channel(c10, i) - channel(c00, i)) * s;
+    float bottom = channel(c01, i) + (channel(c11, i) - channel(c01, i)) * s;
+    sum[i] += weight * (top + (bottom - top) * t);
+  }
+}
+
+void Texture::sample(vec2 uv, float lod, float* out) const {
+  std::fill_n(out, channels(), 0.f);
+  if (levels.empty()) return;
+  // NaN and magnification both sample level 0.
+  if (!(lod > 0)) lod = 0;
+  lod = std::min(lod, (float)(levels.size() - 1));
+  int level = (int)lod;
+  float blend = lod - level;
+  bilinear(level, uv, 1 - blend, out);
+  if (blend > 0) bilinear(level + 1, uv, blend, out);
+}
+
+// Baked texture file, little-endian: a BakedHeader, a BakedLevel per mip
+// level, then the blocks of all levels from data_offset on, exactly as a
+// Texture holds them. data_offset is page-aligned so a mapping of the whole
+// file keeps the blocks cache-line aligned.
+struct BakedHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t format;  // TexelFormat
+  std::uint32_t nlevels;
+  std::uint64_t data_offset;
+  std::uint64_t data_size;
+};
+
+struct BakedLevel {
+  std::uint32_t width, height, blocks_w, reserved;
+  std::uint64_t offset;  // from data_offset
+};
+
+static_assert(sizeof(BakedHeader) == 32 && sizeof(BakedLevel) == 24,
+              "baked texture records must have no padding");
+
+constexpr char BAKED_MAGIC[4] = {'R', 'T', 'E', 'X'};
+constexpr std::uint32_t BAKED_VERSION = 1;
+constexpr std::uint64_t BAKED_ALIGNMENT = 4096;
+
+bool Texture::write_baked(const std::string filename) const {
+  std::ofstream out(filename, std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "can't open file " << filename << "\n";
+    return false;
+  }
+  BakedHeader header = {};
+  std::memcpy(header.magic, BAKED_MAGIC, sizeof(header.magic));
+  header.version = BAKED_VERSION;
+  header.format = (std::uint32_t)texel_format;
+  header.nlevels = levels.size();
+  std::uint64_t table_end = sizeof(header) + levels.size() * sizeof(BakedLevel);
+  header.data_offset = (table_end + BAKED_ALIGNMENT - 1) / BAKED_ALIGNMENT * BAKED_ALIGNMENT;
+  header.data_size = data_size;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const Level& l : levels) {
+    BakedLevel level = {(std::uint32_t)l.width, (std::uint32_t)l.height,
+                        (std::uint32_t)l.blocks_w, 0, l.offset};
+    out.write(reinterpret_cast<const char*>(&level), sizeof(level));
+  }
+  std::vector<char> pad(header.data_offset - table_end, 0);
+  out.write(pad.data(), pad.size());
+  out.write(reinterpret_cast<const char*>(data), data_size);
+  if (!out.good()) {
+    std::cerr << "can't write the baked texture " << filename << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool Texture::read_baked(const std::string filename) {
+  auto file = std::make_shared<MappedFile>(filename);
+  if (!file->bytes || file->size < sizeof(BakedHeader)) {
+    std::cerr << "can't map file " << filename << "\n";
+    return false;
+  }
+  const std::size_t file_size = file->size;
+  // Shares ownership of the mapping, pointing at its bytes.
+  std::shared_ptr<const std::uint8_t> mapping(file, file->bytes);
+
+  // The header must describe exactly the layout this build would produce.
+  BakedHeader header;
+  std::memcpy(&header, file->bytes, sizeof(header));
+  Texture baked;
+  bool valid = std::memcmp(header.magic, BAKED_MAGIC, sizeof(header.magic)) == 0 &&
+               header.version == BAKED_VERSION && header.format <= (std::uint32_t)TexelFormat::BC5 &&
+               header.nlevels > 0 &&
+               sizeof(header) + header.nlevels * sizeof(BakedLevel) <= header.data_offset &&
+               header.data_offset <= file_size && header.data_size <= file_size - header.data_offset;
+  if (valid) {
+    const auto* table = reinterpret_cast<const BakedLevel*>(mapping.get() + sizeof(header));
+    baked.texel_format = (TexelFormat)header.format;
+    baked.block_bytes = block_bytes_of(baked.texel_format);
+    BakedLevel first;
+    std::memcpy(&first, table, sizeof(first));
+    valid = first.width > 0 && first.height > 0 && first.width <= 1u << 16 && first.height <= 1u << 16 &&
+            baked.layout(first.width, first.height) == header.data_size &&
+            baked.levels.size() == header.nlevels;
+    for (std::uint32_t i = 0; valid && i < header.nlevels; i++) {
+      BakedLevel level;
+      std::memcpy(&level, table + i, sizeof(level));
+      const Level& l = baked.levels[i];
+      valid = level.width == (std::uint32_t)l.width && level.height == (std::uint32_t)l.height &&
+              level.blocks_w == (std::uint32_t)l.blocks_w && level.offset == l.offset;
+    }
+  }
+  if (!valid) {
+    std::cerr << "bad baked texture " << filename << "\n";
+    return false;
+  }
+  baked.storage = mapping;
+  baked.data = mapping.get() + header.data_offset;
+  baked.data_size = header.data_size;
+  *this = std::move(baked);
+  return true;
+}
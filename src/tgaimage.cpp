@@ -1,24 +1,92 @@
 #include "tgaimage.h"
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
+#include "mapped_file.h"
+
 TGAImage::TGAImage(const int w, const int h, const int bpp)
     : w(w), h(h), bpp(bpp), data(w * h * bpp, 0) {}
 
-bool TGAImage::read_tga_file(const std::string filename) {
-  std::ifstream in;
-  in.open(filename, std::ios::binary);
-  if (!in.is_open()) {
+namespace {
+
+// Decodes the pixels of a TGA file from [in, end) into `out`, w x h pixels
+// of BPP bytes, straight into their final place: file row j goes to row
+// h - 1 - j if flip_rows, and each row is written right to left if
+// flip_columns. RLE packets may span rows.
+template <int BPP>
+bool decode_pixels(const std::uint8_t* in, const std::uint8_t* end, std::uint8_t* out,
+                   const int w, const int h, const bool rle, const bool flip_rows,
+                   const bool flip_columns) {
+  const std::ptrdiff_t step = flip_columns ? -BPP : BPP;
+  // Where the first pixel of file row j goes.
+  auto row = [&](int j) {
+    return out + ((std::size_t)(flip_rows ? h - 1 - j : j) * w + (flip_columns ? w - 1 : 0)) * BPP;
+  };
+  auto copy = [&](std::uint8_t* dst, const std::uint8_t* src, int n) {
+    if (!flip_columns) {
+      std::memcpy(dst, src, (std::size_t)n * BPP);
+      return;
+    }
+    for (int i = 0; i < n; i++, dst -= BPP, src += BPP) std::memcpy(dst, src, BPP);
+  };
+
+  if (!rle) {
+    const std::size_t pitch = (std::size_t)w * BPP;
+    if ((std::size_t)(end - in) < pitch * h) return false;
+    for (int j = 0; j < h; j++, in += pitch) copy(row(j), in, w);
+    return true;
+  }
+
+  int j = 0, left = w;  // file row being filled, pixels it still needs
+  std::uint8_t* dst = row(0);
+  while (j < h) {
+    if (in == end) return false;
+    const bool run = *in & 128;
+    int n = (*in++ & 127) + 1;
+    if (end - in < (run ? 1 : n) * BPP) return false;
+    while (n) {
+      if (j == h) {
+        std::cerr << "Too many pixels read\n";
+        return false;
+      }
+      int span = std::min(n, left);
+      if (!run) {
+        copy(dst, in, span);
+        in += (std::size_t)span * BPP;
+      } else if (BPP == 1) {
+        std::memset(flip_columns ? dst - span + 1 : dst, *in, span);
+      } else {
+        for (int i = 0; i < span; i++) std::memcpy(dst + i * step, in, BPP);
+      }
+      dst += span * step;
+      n -= span;
+      left -= span;
+      if (!left) {
+        if (++j < h) dst = row(j);
+        left = w;
+      }
+    }
+    if (run) in += BPP;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool TGAImage::read_tga_file(const std::string filename, const bool vflip) {
+  MappedFile file(filename);
+  if (!file.bytes) {
     std::cerr << "can't open file " << filename << "\n";
     return false;
   }
   TGAHeader header;
-  in.read(reinterpret_cast<char*>(&header), sizeof(header));
-  if (!in.good()) {
+  if (file.size < sizeof(header)) {
     std::cerr << "an error occured while reading the header\n";
     return false;
   }
+  std::memcpy(&header, file.bytes, sizeof(header));
   w = header.width;
   h = header.height;
   bpp = header.bitsperpixel >> 3;
@@ -26,76 +94,34 @@ bool TGAImage::read_tga_file(const std::string filename) {
     std::cerr << "bad bpp (or width/height) value\n";
     return false;
   }
-  size_t nbytes = bpp * w * h;
-  data = std::vector<std::uint8_t>(nbytes, 0);
-  if (3 == header.datatypecode || 2 == header.datatypecode) {
-    in.read(reinterpret_cast<char*>(data.data()), nbytes);
-    if (!in.good()) {
-      std::cerr << "an error occured while reading the data\n";
-      return false;
-    }
-  } else if (10 == header.datatypecode || 11 == header.datatypecode) {
-    if (!load_rle_data(in)) {
-      std::cerr << "an error occured while reading the data\n";
-      return false;
-    }
-  } else {
+  bool rle = 10 == header.datatypecode || 11 == header.datatypecode;
+  if (!rle && 3 != header.datatypecode && 2 != header.datatypecode) {
     std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
     return false;
   }
-  if (!(header.imagedescriptor & 0x20)) flip_vertically();
-  if (header.imagedescriptor & 0x10) flip_horizontally();
+  // Pixels follow the image id and the color map, if any.
+  std::size_t offset = sizeof(header) + header.idlength;
+  if (header.colormaptype)
+    offset += (std::size_t)header.colormaplength * ((header.colormapdepth + 7) >> 3);
+  data = std::vector<std::uint8_t>((std::size_t)bpp * w * h);
+  const std::uint8_t* in = file.bytes + std::min(offset, file.size);
+  const std::uint8_t* end = file.bytes + file.size;
+  bool flip_rows = !(header.imagedescriptor & 0x20) != vflip;
+  bool flip_columns = header.imagedescriptor & 0x10;
+  bool ok = false;
+  switch (bpp) {
+    case GRAYSCALE: ok = decode_pixels<1>(in, end, data.data(), w, h, rle, flip_rows, flip_columns); break;
+    case RGB: ok = decode_pixels<3>(in, end, data.data(), w, h, rle, flip_rows, flip_columns); break;
+    case RGBA: ok = decode_pixels<4>(in, end, data.data(), w, h, rle, flip_rows, flip_columns); break;
+  }
+  if (!ok) {
+    std::cerr << "an error occured while reading the data\n";
+    return false;
+  }
   std::cerr << w << "x" << h << "/" << bpp * 8 << "\n";
   return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream& in) {
-  size_t pixelcount = w * h;
-  size_t currentpixel = 0;
-  size_t currentbyte = 0;
-  TGAColor colorbuffer;
-  do {
-    std::uint8_t chunkheader = 0;
-    chunkheader = in.get();
-    if (!in.good()) {
-      std::cerr << "an error occured while reading the data\n";
-      return false;
-    }
-    if (chunkheader < 128) {
-      chunkheader++;
-      for (int i = 0; i < chunkheader; i++) {
-        in.read(reinterpret_cast<char*>(colorbuffer.bgra), bpp);
-        if (!in.good()) {
-          std::cerr << "an error occured while reading the header\n";
-          return false;
-        }
-        for (int t = 0; t < bpp; t++) data[currentbyte++] = colorbuffer.bgra[t];
-        currentpixel++;
-        if (currentpixel > pixelcount) {
-          std::cerr << "Too many pixels read\n";
-          return false;
-        }
-      }
-    } else {
-      chunkheader -= 127;
-      in.read(reinterpret_cast<char*>(colorbuffer.bgra), bpp);
-      if (!in.good()) {
-        std::cerr << "an error occured while reading the header\n";
-        return false;
-      }
-      for (int i = 0; i < chunkheader; i++) {
-        for (int t = 0; t < bpp; t++) data[currentbyte++] = colorbuffer.bgra[t];
-        currentpixel++;
-        if (currentpixel > pixelcount) {
-          std::cerr << "Too many pixels read\n";
-          return false;
-        }
-      }
-    }
-  } while (currentpixel < pixelcount);
-  return true;
-}
-
 bool TGAImage::write_tga_file(const std::string filename, const bool vflip,
                               const bool rle) const {
   constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
@@ -103,6 +129,9 @@ bool TGAImage::write_tga_file(const std::string filename, const bool vflip,
   constexpr std::uint8_t footer[18] = {'T', 'R', 'U', 'E', 'V', 'I',
                                        'S', 'I', 'O', 'N', '-', 'X',
                                        'F', 'I', 'L', 'E', '.', '\0'};
+  // Encode first, so the file is written in a few large writes.
+  std::vector<std::uint8_t> packets;
+  if (rle) packets = rle_data();
   std::ofstream out;
   out.open(filename, std::ios::binary);
   if (!out.is_open()) {
@@ -118,11 +147,11 @@ bool TGAImage::write_tga_file(const std::string filename, const bool vflip,
       vflip ? 0x00 : 0x20;  // top-left or bottom-left origin
   out.write(reinterpret_cast<const char*>(&header), sizeof(header));
   if (!out.good()) goto err;
-  if (!rle) {
+  if (!rle)
     out.write(reinterpret_cast<const char*>(data.data()), w * h * bpp);
-    if (!out.good()) goto err;
-  } else if (!unload_rle_data(out))
-    goto err;
+  else
+    out.write(reinterpret_cast<const char*>(packets.data()), packets.size());
+  if (!out.good()) goto err;
   out.write(reinterpret_cast<const char*>(developer_area_ref),
             sizeof(developer_area_ref));
   if (!out.good()) goto err;
@@ -137,19 +166,39 @@ err:
   return false;
 }
 
-bool TGAImage::unload_rle_data(std::ofstream& out) const {
+std::vector<std::uint8_t> TGAImage::rle_data() const {
+  // Bands of rows are encoded in parallel. Packets stop at band boundaries,
+  // so the bands' packets are simply concatenated.
+  constexpr int BAND_ROWS = 32;
+  const int nbands = (h + BAND_ROWS - 1) / BAND_ROWS;
+  std::vector<std::vector<std::uint8_t>> bands(nbands);
+  #pragma omp parallel for schedule(dynamic) if (nbands > 1)
+  for (int b = 0; b < nbands; b++) {
+    std::size_t begin = (std::size_t)b * BAND_ROWS * w;
+    std::size_t end = (std::size_t)std::min((b + 1) * BAND_ROWS, h) * w;
+    unload_rle_data(begin, end, bands[b]);
+  }
+  std::size_t size = 0;
+  for (const auto& band : bands) size += band.size();
+  std::vector<std::uint8_t> packets;
+  packets.reserve(size);
+  for (const auto& band : bands) packets.insert(packets.end(), band.begin(), band.end());
+  return packets;
+}
+
+void TGAImage::unload_rle_data(const std::size_t begin, const std::size_t end,
+                               std::vector<std::uint8_t>& out) const {
   const std::uint8_t max_chunk_length = 128;
-  size_t npixels = w * h;
-  size_t curpix = 0;
-  while (curpix < npixels) {
+  // Worst case: a raw packet every 128 pixels.
+  out.reserve((end - begin) * bpp + (end - begin + max_chunk_length - 1) / max_chunk_length);
+  size_t curpix = begin;
+  while (curpix < end) {
     size_t chunkstart = curpix * bpp;
     size_t curbyte = curpix * bpp;
     std::uint8_t run_length = 1;
     bool raw = true;
-    while (curpix + run_length < npixels && run_length < max_chunk_length) {
-      bool succ_eq = true;
-      for (int t = 0; succ_eq && t < bpp; t++)
-        succ_eq = (data[curbyte + t] == data[curbyte + t + bpp]);
+    while (curpix + run_length < end && run_length < max_chunk_length) {
+      bool succ_eq = std::memcmp(&data[curbyte], &data[curbyte + bpp], bpp) == 0;
       curbyte += bpp;
       if (1 == run_length) raw = !succ_eq;
       if (raw && succ_eq) {
@@ -160,13 +209,10 @@ bool TGAImage::unload_rle_data(std::ofstream& out) const {
       run_length++;
     }
     curpix += run_length;
-    out.put(raw ? run_length - 1 : run_length + 127);
-    if (!out.good()) return false;
-    out.write(reinterpret_cast<const char*>(data.data() + chunkstart),
-              (raw ? run_length * bpp : bpp));
-    if (!out.good()) return false;
+    out.push_back(raw ? run_length - 1 : run_length + 127);
+    out.insert(out.end(), data.begin() + chunkstart,
+               data.begin() + chunkstart + (raw ? run_length * bpp : bpp));
   }
-  return true;
 }
 
 TGAColor TGAImage::get(const int x, const int y) const {
@@ -183,19 +229,18 @@ void TGAImage::set(int x, int y, const TGAColor& c) {
 }
 
 void TGAImage::flip_horizontally() {
-  for (int i = 0; i < w / 2; i++)
-    for (int j = 0; j < h; j++)
-      for (int b = 0; b < bpp; b++)
-        std::swap(data[(i + j * w) * bpp + b],
-                  data[(w - 1 - i + j * w) * bpp + b]);
+  for (int j = 0; j < h; j++) {
+    std::uint8_t* row = data.data() + (std::size_t)j * w * bpp;
+    for (int i = 0; i < w / 2; i++)
+      std::swap_ranges(row + i * bpp, row + (i + 1) * bpp, row + (w - 1 - i) * bpp);
+  }
 }
 
 void TGAImage::flip_vertically() {
-  for (int i = 0; i < w; i++)
-    for (int j = 0; j < h / 2; j++)
-      for (int b = 0; b < bpp; b++)
-        std::swap(data[(i + j * w) * bpp + b],
-                  data[(i + (h - 1 - j) * w) * bpp + b]);
+  const std::size_t pitch = (std::size_t)w * bpp;
+  for (int j = 0; j < h / 2; j++)
+    std::swap_ranges(data.begin() + j * pitch, data.begin() + (j + 1) * pitch,
+                     data.begin() + (h - 1 - j) * pitch);
 }
 
 int TGAImage::width() const { return w; }
@@ -206,6 +251,13 @@ void TGAImage::clear() {
   std::fill(data.begin(), data.end(), 0);
 }
 
+void TGAImage::clear(const int x, const int y, const int rw, const int rh) {
+  int x0 = std::max(x, 0), x1 = std::min(x + rw, w);
+  if (x0 >= x1) return;
+  for (int j = std::max(y, 0); j < std::min(y + rh, h); j++)
+    std::fill_n(data.data() + (x0 + j * w) * bpp, (x1 - x0) * bpp, 0);
+}
+
 std::uint8_t* TGAImage::buffer() {
   return data.data();
 }
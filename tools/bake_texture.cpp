@@ -0,0 +1,46 @@
+// Bakes a TGA image into a .tex texture: texels converted, mips built and
+// blocks laid out as the renderer samples them, ready to be mapped at load.
+//
+//   bake_texture input.tga output.tex [bgra8|r8|normal8|bc1|bc4|bc5]
+//
+// The format defaults to bgra8. Mesh loads diffuse maps as bgra8 or bc1,
+// normal maps as normal8 or bc5 and specular maps as r8 or bc4.
+#include "texture.h"
+#include "tgaimage.h"
+
+#include <iostream>
+#include <string>
+
+int main(int argc, char** argv) {
+    const std::pair<const char*, TexelFormat> formats[] = {
+        {"bgra8", TexelFormat::BGRA8}, {"r8", TexelFormat::R8}, {"normal8", TexelFormat::NORMAL8},
+        {"bc1", TexelFormat::BC1},     {"bc4", TexelFormat::BC4}, {"bc5", TexelFormat::BC5},
+    };
+    if (argc < 3 || argc > 4) {
+        std::cerr << "usage: " << argv[0] << " input.tga output.tex [bgra8|r8|normal8|bc1|bc4|bc5]\n";
+        return 1;
+    }
+    TexelFormat format = TexelFormat::BGRA8;
+    if (argc == 4) {
+        bool found = false;
+        for (const auto& [name, f] : formats) {
+            if (argv[3] == std::string(name)) {
+                format = f;
+                found = true;
+            }
+        }
+        if (!found) {
+            std::cerr << "unknown format " << argv[3] << "\n";
+            return 1;
+        }
+    }
+
+    // Rows bottom to top, as Mesh loads them: v = 0 is the bottom row.
+    TGAImage image;
+    if (!image.read_tga_file(argv[1], true)) return 1;
+    Texture texture(image, format);
+    if (!texture.write_baked(argv[2])) return 1;
+    std::cout << argv[2] << ": " << texture.width() << "x" << texture.height() << ", "
+              << texture.nlevels() << " levels, " << texture.size_bytes() << " bytes\n";
+    return 0;
+}
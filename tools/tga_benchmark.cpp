@@ -0,0 +1,157 @@
+// Times TGAImage::read_tga_file against the previous ifstream-based reader,
+// kept below as the baseline, and checks that both decode the same pixels.
+//
+//   tga_benchmark [-n repeats] [file.tga ...]
+//
+// With no files it loads every assets/*.tga, as main.cpp lists them. Both
+// readers load with vflip set, as Mesh does.
+#include "tgaimage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// The reader as it was: header and pixels through ifstream, RLE packets one
+// get() and read() at a time, then column-major flips.
+struct LegacyImage {
+    int w = 0, h = 0, bpp = 0;
+    std::vector<std::uint8_t> data;
+
+    bool read(const std::string& filename, bool vflip) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in.is_open()) return false;
+        TGAHeader header;
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in.good()) return false;
+        w = header.width;
+        h = header.height;
+        bpp = header.bitsperpixel >> 3;
+        if (w <= 0 || h <= 0 || (bpp != 1 && bpp != 3 && bpp != 4)) return false;
+        in.ignore(header.idlength);
+        if (header.colormaptype) in.ignore(header.colormaplength * ((header.colormapdepth + 7) >> 3));
+        data.assign((std::size_t)bpp * w * h, 0);
+        if (header.datatypecode == 2 || header.datatypecode == 3) {
+            in.read(reinterpret_cast<char*>(data.data()), data.size());
+            if (!in.good()) return false;
+        } else if (header.datatypecode == 10 || header.datatypecode == 11) {
+            if (!read_rle(in)) return false;
+        } else {
+            return false;
+        }
+        if (!(header.imagedescriptor & 0x20) != vflip) flip_vertically();
+        if (header.imagedescriptor & 0x10) flip_horizontally();
+        return true;
+    }
+
+    bool read_rle(std::ifstream& in) {
+        std::size_t pixelcount = (std::size_t)w * h, currentpixel = 0, currentbyte = 0;
+        std::uint8_t color[4];
+        do {
+            std::uint8_t chunkheader = in.get();
+            if (!in.good()) return false;
+            if (chunkheader < 128) {
+                for (int i = 0; i <= chunkheader; i++) {
+                    in.read(reinterpret_cast<char*>(color), bpp);
+                    if (!in.good() || ++currentpixel > pixelcount) return false;
+                    for (int t = 0; t < bpp; t++) data[currentbyte++] = color[t];
+                }
+            } else {
+                in.read(reinterpret_cast<char*>(color), bpp);
+                if (!in.good()) return false;
+                for (int i = 0; i < chunkheader - 127; i++) {
+                    if (++currentpixel > pixelcount) return false;
+                    for (int t = 0; t < bpp; t++) data[currentbyte++] = color[t];
+                }
+            }
+        } while (currentpixel < pixelcount);
+        return true;
+    }
+
+    void flip_horizontally() {
+        for (int i = 0; i < w / 2; i++)
+            for (int j = 0; j < h; j++)
+                for (int b = 0; b < bpp; b++)
+                    std::swap(data[(i + j * w) * bpp + b], data[(w - 1 - i + j * w) * bpp + b]);
+    }
+
+    void flip_vertically() {
+        for (int i = 0; i < w; i++)
+            for (int j = 0; j < h / 2; j++)
+                for (int b = 0; b < bpp; b++)
+                    std::swap(data[(i + j * w) * bpp + b], data[(i + (h - 1 - j) * w) * bpp + b]);
+    }
+};
+
+// Best of `repeats` runs, in milliseconds.
+template <typename F>
+double best_ms(int repeats, F&& load) {
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++) {
+        auto start = std::chrono::steady_clock::now();
+        load();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    int repeats = 10;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-n") == 0 && i + 1 < argc) repeats = std::max(1, std::atoi(argv[++i]));
+        else files.push_back(argv[i]);
+    }
+    if (files.empty() && fs::is_directory("assets")) {
+        for (const auto& entry : fs::directory_iterator("assets"))
+            if (entry.path().extension() == ".tga") files.push_back(entry.path().string());
+        std::sort(files.begin(), files.end());
+    }
+    if (files.empty()) {
+        std::cerr << "usage: " << argv[0] << " [-n repeats] [file.tga ...]\n";
+        return 1;
+    }
+
+    std::printf("%-40s %-12s %9s  %9s  %7s\n", "file", "size", "legacy ms", "mapped ms", "speedup");
+    double total_legacy = 0, total_mapped = 0;
+    bool all_match = true;
+    for (const std::string& file : files) {
+        LegacyImage legacy;
+        TGAImage image;
+        bool legacy_ok = legacy.read(file, true);
+        bool mapped_ok = image.read_tga_file(file, true);
+        if (!legacy_ok || !mapped_ok) {
+            std::cerr << file << ": failed to load\n";
+            all_match = false;
+            continue;
+        }
+        bool match = legacy.w == image.width() && legacy.h == image.height() &&
+                     std::memcmp(legacy.data.data(), image.buffer(), legacy.data.size()) == 0;
+        all_match = all_match && match;
+
+        // read_tga_file reports every image on stderr; keep it out of the timing.
+        std::streambuf* log = std::cerr.rdbuf(nullptr);
+        double legacy_ms = best_ms(repeats, [&] { LegacyImage l; l.read(file, true); });
+        double mapped_ms = best_ms(repeats, [&] { TGAImage t; t.read_tga_file(file, true); });
+        std::cerr.rdbuf(log);
+        std::cerr.clear();
+        total_legacy += legacy_ms;
+        total_mapped += mapped_ms;
+
+        std::string dims = std::to_string(legacy.w) + "x" + std::to_string(legacy.h) + "/" + std::to_string(legacy.bpp * 8);
+        std::printf("%-40s %-12s %9.2f  %9.2f  %6.1fx%s\n", fs::path(file).filename().string().c_str(),
+                    dims.c_str(), legacy_ms, mapped_ms, legacy_ms / mapped_ms, match ? "" : "  MISMATCH");
+    }
+    std::printf("%-53s %9.2f  %9.2f  %6.1fx\n", "total", total_legacy, total_mapped,
+                total_mapped > 0 ? total_legacy / total_mapped : 0.0);
+    return all_match ? 0 : 1;
+}